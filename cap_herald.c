@@ -28,7 +28,8 @@
 #include <sys/endian.h>
 #include <sys/iov.h>
 #include <sys/nv.h>
-#include <sys/dnv.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #include <netinet/in.h>
 #include <netinet/netdump/netdump.h>
@@ -36,6 +37,8 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,23 +55,35 @@
  * to the destination address of the message and an ephemeral port. Such a
  * socket cannot be created in capability mode.
  *
- * The herald service reads a herald message from the pre-defined server socket.
- * If the message is valid, the service will create, bind, and connect a socket
- * with which to continue the transfer, and will the send the socket and some
- * other client parameters to netdumpd.
+ * The herald service reads herald messages from the pre-defined server socket.
+ * For each valid message, the service will create, bind, and connect a socket
+ * with which to continue the transfer, and will then send the socket and some
+ * other client parameters to netdumpd. Any protocol extensions requested by the
+ * client are passed on in host byte order; nh_ext is zeroed if there are none.
+ * A client requesting several streams gets up to maxstreams sockets.
+ *
+ * Heralds arrive in bursts when many hosts panic at once, so the service drains
+ * up to maxheralds queued messages per request, returning the number of heralds
+ * in *nheraldsp, which is 0 if the socket only held invalid messages. An error
+ * is returned only if one kept every herald from being processed.
  */
 
 int
-netdump_cap_herald(cap_channel_t *cap, int *nsd, struct sockaddr_in *sin,
-    uint32_t *seqno, char **pathp)
+netdump_cap_herald(cap_channel_t *cap, int maxstreams,
+    struct netdump_herald *heralds, int maxheralds, int *nheraldsp)
 {
-	nvlist_t *nvl;
+	char name[16];
+	struct netdump_herald *nh;
+	nvlist_t *hnvl, *nvl;
 	const struct sockaddr_in *sinp;
+	const void *ext;
 	size_t sz;
-	int error;
+	int error, i, n;
 
 	nvl = nvlist_create(0);
 	nvlist_add_string(nvl, "cmd", "herald");
+	nvlist_add_number(nvl, "maxstreams", (uint64_t)maxstreams);
+	nvlist_add_number(nvl, "maxheralds", (uint64_t)maxheralds);
 #if __FreeBSD_version >= 1200000
 	nvl = cap_xfer_nvlist(cap, nvl);
 #else
@@ -77,49 +92,257 @@ netdump_cap_herald(cap_channel_t *cap, int *nsd, struct sockaddr_in *sin,
 	if (nvl == NULL)
 		return (errno);
 
-	error = (int)dnvlist_get_number(nvl, "errror", 0);
+	error = (int)dnvlist_get_number(nvl, "error", 0);
 	if (error != 0)
 		goto out;
 
 	/* Fetch output values. */
-	sinp = nvlist_get_binary(nvl, "srcaddr", &sz);
-	if (sz != sizeof(*sin))
-		errx(1, "size mismatch for 'srcaddr': got %zu", sz);
-	memcpy(sin, sinp, sizeof(*sin));
-	*pathp = dnvlist_take_string(nvl, "path", NULL);
-	*seqno = (uint32_t)nvlist_get_number(nvl, "seqno");
-	*nsd = nvlist_take_descriptor(nvl, "socket");
+	n = (int)MIN(nvlist_get_number(nvl, "count"), (uint64_t)maxheralds);
+	for (i = 0; i < n; i++) {
+		nh = &heralds[i];
+		snprintf(name, sizeof(name), "herald%d", i);
+		hnvl = nvlist_take_nvlist(nvl, name);
+		sinp = nvlist_get_binary(hnvl, "srcaddr", &sz);
+		if (sz != sizeof(nh->nh_sin))
+			errx(1, "size mismatch for 'srcaddr': got %zu", sz);
+		memcpy(&nh->nh_sin, sinp, sizeof(nh->nh_sin));
+		nh->nh_path = dnvlist_take_string(hnvl, "path", NULL);
+		nh->nh_seqno = (uint32_t)nvlist_get_number(hnvl, "seqno");
+		nh->nh_rcvtime = dnvlist_get_number(hnvl, "rcvtime", 0);
+		nh->nh_sds[0] = nvlist_take_descriptor(hnvl, "socket");
+		for (nh->nh_nsds = 1; nh->nh_nsds < maxstreams &&
+		    nh->nh_nsds < NETDUMP_STREAMS_MAX; nh->nh_nsds++) {
+			snprintf(name, sizeof(name), "socket%d", nh->nh_nsds);
+			if (!nvlist_exists_descriptor(hnvl, name))
+				break;
+			nh->nh_sds[nh->nh_nsds] =
+			    nvlist_take_descriptor(hnvl, name);
+		}
+		memset(&nh->nh_ext, 0, sizeof(nh->nh_ext));
+		if (nvlist_exists_binary(hnvl, "ext")) {
+			ext = nvlist_get_binary(hnvl, "ext", &sz);
+			if (sz != sizeof(nh->nh_ext))
+				errx(1, "size mismatch for 'ext': got %zu", sz);
+			memcpy(&nh->nh_ext, ext, sizeof(nh->nh_ext));
+		}
+		nvlist_destroy(hnvl);
+	}
+	*nheraldsp = n;
 out:
 	nvlist_destroy(nvl);
 	return (error);
 }
 
+/*
+ * Sockets bound to a local address and an ephemeral port, created ahead of
+ * time so that answering a herald only takes a connect(2). There is a pool for
+ * each address heralds were sent to, up to HERALD_POOL_ADDRS of them, which a
+ * background thread refills once it runs low. netdumpd sets the number of
+ * sockets kept per address, up to NETDUMP_HERALD_POOL_MAX, with 0 disabling
+ * the pools. The thread is stopped when the service exits.
+ */
+#define	HERALD_POOL_ADDRS	8	/* Addresses with a pool. */
+
+struct herald_pool {
+	struct in_addr	addr;
+	int		nsds;
+	int		sds[NETDUMP_HERALD_POOL_MAX];
+};
+
+static struct herald_pool g_pools[HERALD_POOL_ADDRS];
+static int g_npools;
+static int g_pool_size;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pool_cv = PTHREAD_COND_INITIALIZER;
+static pthread_t g_pool_thread;
+static bool g_pool_running;
+static bool g_pool_exiting;
+
+/* Create a socket bound to a local address and an ephemeral port. */
+static int
+herald_bind(struct in_addr dst, int *sdp)
+{
+	struct sockaddr_in sin;
+	int error, sd;
+
+	sd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    IPPROTO_UDP);
+	if (sd < 0)
+		return (errno);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_len = sizeof(sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = dst.s_addr;
+	sin.sin_port = htons(0);
+	if (bind(sd, (struct sockaddr *)&sin, sin.sin_len) != 0) {
+		error = errno;
+		(void)close(sd);
+		return (error);
+	}
+	*sdp = sd;
+	return (0);
+}
+
+static void *
+herald_pool_main(void *arg __unused)
+{
+	struct herald_pool *pool;
+	int i, sd;
+
+	pthread_mutex_lock(&g_pool_lock);
+	while (!g_pool_exiting) {
+		for (i = 0; i < g_npools && !g_pool_exiting; i++) {
+			pool = &g_pools[i];
+			while (pool->nsds < g_pool_size && !g_pool_exiting) {
+				pthread_mutex_unlock(&g_pool_lock);
+				if (herald_bind(pool->addr, &sd) != 0) {
+					pthread_mutex_lock(&g_pool_lock);
+					break;
+				}
+				pthread_mutex_lock(&g_pool_lock);
+				if (pool->nsds < g_pool_size)
+					pool->sds[pool->nsds++] = sd;
+				else
+					(void)close(sd);
+			}
+		}
+		if (!g_pool_exiting)
+			pthread_cond_wait(&g_pool_cv, &g_pool_lock);
+	}
+	pthread_mutex_unlock(&g_pool_lock);
+	return (NULL);
+}
+
+/* Stop the refill thread and close the pooled sockets at service exit. */
+static void
+herald_pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&g_pool_lock);
+	g_pool_exiting = true;
+	pthread_cond_signal(&g_pool_cv);
+	pthread_mutex_unlock(&g_pool_lock);
+	(void)pthread_join(g_pool_thread, NULL);
+
+	for (i = 0; i < g_npools; i++)
+		while (g_pools[i].nsds > 0)
+			(void)close(g_pools[i].sds[--g_pools[i].nsds]);
+	g_npools = 0;
+}
+
+/* Size the pools and start the refill thread, on the first request. */
+static void
+herald_pool_init(int size)
+{
+
+	if (g_pool_running || size == 0)
+		return;
+	pthread_mutex_lock(&g_pool_lock);
+	g_pool_size = size;
+	pthread_mutex_unlock(&g_pool_lock);
+	if (pthread_create(&g_pool_thread, NULL, herald_pool_main, NULL) != 0)
+		return;
+	g_pool_running = true;
+	(void)atexit(herald_pool_stop);
+}
+
+/*
+ * Take a socket from the pool of a local address, starting a pool for the
+ * address if there is none. Returns -1 if the pool is empty.
+ */
 static int
-herald_command(const char *cmd, const nvlist_t *limits,
-    nvlist_t *nvlin __unused, nvlist_t *nvlout)
+herald_pool_get(struct in_addr dst)
+{
+	struct herald_pool *pool;
+	int i, sd;
+
+	if (!g_pool_running)
+		return (-1);
+	sd = -1;
+	pthread_mutex_lock(&g_pool_lock);
+	for (i = 0; i < g_npools; i++) {
+		if (g_pools[i].addr.s_addr == dst.s_addr)
+			break;
+	}
+	if (i == g_npools) {
+		if (g_npools == HERALD_POOL_ADDRS) {
+			pthread_mutex_unlock(&g_pool_lock);
+			return (-1);
+		}
+		g_pools[g_npools++].addr = dst;
+	}
+	pool = &g_pools[i];
+	if (pool->nsds > 0)
+		sd = pool->sds[--pool->nsds];
+	if (pool->nsds <= g_pool_size / 2)
+		pthread_cond_signal(&g_pool_cv);
+	pthread_mutex_unlock(&g_pool_lock);
+	return (sd);
+}
+
+/*
+ * Get a socket bound to the address a herald was sent to and an ephemeral
+ * port, and connected to the client's ACK port.
+ */
+static int
+herald_socket(struct in_addr dst, const struct sockaddr_in *from, int *sdp)
+{
+	char buf[1];
+	int error, sd;
+
+	sd = herald_pool_get(dst);
+	if (sd < 0) {
+		error = herald_bind(dst, &sd);
+		if (error != 0)
+			return (error);
+	}
+	if (connect(sd, (const struct sockaddr *)from, from->sin_len) != 0) {
+		error = errno;
+		(void)close(sd);
+		return (error);
+	}
+
+	/* Discard anything a pooled socket received before it was connected. */
+	while (recv(sd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+		;
+	*sdp = sd;
+	return (0);
+}
+
+/*
+ * Read one herald from the server socket and marshall its parameters into
+ * nvlout.
+ */
+static int
+herald_recv(int sd, int maxstreams, nvlist_t *nvlout)
 {
 	struct {
 		struct netdump_msg_hdr hdr;
-		char data[MAXPATHLEN];
+		char data[MAXPATHLEN + sizeof(struct netdump_herald_ext)];
 	} ndmsg;
+	struct netdump_herald_ext ext;
 	struct iovec iov;
 	struct msghdr msg;
 	struct sockaddr_storage ss;
-	struct sockaddr_in sin, *from;
+	struct sockaddr_in *from;
 	struct cmsghdr *cmh;
 	struct in_addr *dip;
-	size_t cmsgsz, pathsz;
+	struct timeval rcvtime;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(struct in_addr)) +
+				    CMSG_SPACE(sizeof(struct timeval))];
+	} cmsgbuf;
+	char name[16];
+	size_t extsz, pathsz;
 	ssize_t len;
-	int error, sd, nsd;
-
-	error = 0;
-	nsd = -1;
-
-	if (strcmp(cmd, "herald") != 0)
-		return (EINVAL);
+	int error, i, nstreams, nsd, xsd;
 
 	memset(&msg, 0, sizeof(msg));
 	memset(&ss, 0, sizeof(ss));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
 
 	iov.iov_base = &ndmsg;
 	iov.iov_len = sizeof(ndmsg);
@@ -128,80 +351,146 @@ herald_command(const char *cmd, const nvlist_t *limits,
 	msg.msg_namelen = sizeof(ss);
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
 
-	cmsgsz = CMSG_SPACE(sizeof(struct in_addr));
-	msg.msg_control = calloc(1, cmsgsz);
-	if (msg.msg_control == NULL) {
-		error = errno;
-		goto out;
-	}
-	msg.msg_controllen = cmsgsz;
-
-	sd = nvlist_get_descriptor(limits, "socket");
-	len = recvmsg(sd, &msg, 0);
-	if (len < 0) {
-		error = errno;
-		goto out;
-	}
+	len = recvmsg(sd, &msg, MSG_DONTWAIT);
+	if (len < 0)
+		return (errno);
 
-	if ((size_t)len < sizeof(struct netdump_msg_hdr)) {
-		error = EINVAL;
-		goto out;
-	}
+	if ((size_t)len < sizeof(struct netdump_msg_hdr))
+		return (EINVAL);
 	ndtoh(&ndmsg.hdr);
 	if (ndmsg.hdr.mh_type != NETDUMP_HERALD ||
 	    (size_t)len - sizeof(struct netdump_msg_hdr) != ndmsg.hdr.mh_len ||
-	    ss.ss_family != AF_INET) {
-		error = EINVAL;
-		goto out;
-	}
+	    ss.ss_family != AF_INET)
+		return (EINVAL);
 
-	cmh = CMSG_FIRSTHDR(&msg);
-	if (cmh->cmsg_level != IPPROTO_IP || cmh->cmsg_type != IP_RECVDSTADDR) {
-		error = EINVAL;
-		goto out;
-	}
-	dip = (struct in_addr *)(void *)CMSG_DATA(msg.msg_control);
-
-	nsd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
-	    IPPROTO_UDP);
-	if (nsd < 0) {
-		error = errno;
-		goto out;
-	}
-
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_len = sizeof(sin);
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = dip->s_addr;
-	sin.sin_port = htons(0);
-	if (bind(nsd, (struct sockaddr *)&sin, sin.sin_len) != 0) {
-		error = errno;
-		goto out;
+	dip = NULL;
+	timerclear(&rcvtime);
+	for (cmh = CMSG_FIRSTHDR(&msg); cmh != NULL;
+	    cmh = CMSG_NXTHDR(&msg, cmh)) {
+		if (cmh->cmsg_level == IPPROTO_IP &&
+		    cmh->cmsg_type == IP_RECVDSTADDR)
+			dip = (struct in_addr *)(void *)CMSG_DATA(cmh);
+		else if (cmh->cmsg_level == SOL_SOCKET &&
+		    cmh->cmsg_type == SCM_TIMESTAMP)
+			memcpy(&rcvtime, CMSG_DATA(cmh), sizeof(rcvtime));
 	}
+	if (dip == NULL)
+		return (EINVAL);
+	if (!timerisset(&rcvtime))
+		(void)gettimeofday(&rcvtime, NULL);
 
 	from = (struct sockaddr_in *)msg.msg_name;
 	from->sin_port = htons(NETDUMP_ACKPORT);
-	if (connect(nsd, (struct sockaddr *)from, from->sin_len) != 0) {
-		error = errno;
-		goto out;
-	}
+	error = herald_socket(*dip, from, &nsd);
+	if (error != 0)
+		return (error);
 
 	/* Marshall out-params. */
 	nvlist_move_descriptor(nvlout, "socket", nsd);
 	nvlist_add_number(nvlout, "seqno", (uint64_t)ndmsg.hdr.mh_seqno);
-	pathsz = ndmsg.hdr.mh_len;
-	if (pathsz > 0 && pathsz <= MIN(MAXPATHLEN, NETDUMP_DATASIZE) &&
-	    ndmsg.data[pathsz - 1] == '\0')
+	nvlist_add_number(nvlout, "rcvtime", (uint64_t)rcvtime.tv_sec *
+	    1000000 + rcvtime.tv_usec);
+
+	/*
+	 * The payload is an optional NUL-terminated path, which may be followed
+	 * by a protocol extension header.
+	 */
+	memset(&ext, 0, sizeof(ext));
+	pathsz = strnlen(ndmsg.data, ndmsg.hdr.mh_len);
+	if (pathsz > 0 && pathsz < ndmsg.hdr.mh_len &&
+	    pathsz < MIN(MAXPATHLEN, NETDUMP_DATASIZE))
 		nvlist_add_string(nvlout, "path", ndmsg.data);
+	if (pathsz < ndmsg.hdr.mh_len) {
+		extsz = ndmsg.hdr.mh_len - pathsz - 1;
+		memcpy(&ext, &ndmsg.data[pathsz + 1], MIN(extsz, sizeof(ext)));
+		if (extsz >= sizeof(ext.nhe_magic) &&
+		    ntohl(ext.nhe_magic) == NETDUMP_EXT_MAGIC) {
+			ext.nhe_magic = ntohl(ext.nhe_magic);
+			ext.nhe_flags = ntohl(ext.nhe_flags);
+			ext.nhe_datasize = ntohl(ext.nhe_datasize);
+			ext.nhe_ackpkts = ntohl(ext.nhe_ackpkts);
+			ext.nhe_ackusec = ntohl(ext.nhe_ackusec);
+			ext.nhe_nstreams = ntohl(ext.nhe_nstreams);
+			ext.nhe_fecgroup = ntohl(ext.nhe_fecgroup);
+			ext.nhe_token = be64toh(ext.nhe_token);
+			nvlist_add_binary(nvlout, "ext", &ext, sizeof(ext));
+		} else
+			memset(&ext, 0, sizeof(ext));
+	}
 	nvlist_add_binary(nvlout, "srcaddr", from, sizeof(*from));
 
-out:
-	if (msg.msg_control != NULL)
-		free(msg.msg_control);
-	if (error != 0 && nsd >= 0)
-		(void)close(nsd);
-	return (error);
+	/*
+	 * Each additional stream gets its own socket. Failing to create one
+	 * just leaves the client with fewer streams. Resumable dumps are not
+	 * striped.
+	 */
+	nstreams = 1;
+	if ((ext.nhe_flags & NETDUMP_EXT_STREAMS) != 0 &&
+	    (ext.nhe_flags & NETDUMP_EXT_RESUME) == 0)
+		nstreams = (int)MIN(ext.nhe_nstreams,
+		    (uint32_t)MIN(NETDUMP_STREAMS_MAX, maxstreams));
+	for (i = 1; i < nstreams; i++) {
+		if (herald_socket(*dip, from, &xsd) != 0)
+			break;
+		snprintf(name, sizeof(name), "socket%d", i);
+		nvlist_move_descriptor(nvlout, name, xsd);
+	}
+	return (0);
+}
+
+/*
+ * Drain up to maxheralds messages from the server socket, stopping at the first
+ * empty read. Invalid messages are skipped.
+ */
+static int
+herald_command(const char *cmd, const nvlist_t *limits, nvlist_t *nvlin,
+    nvlist_t *nvlout)
+{
+	char name[16];
+	nvlist_t *nvl;
+	uint64_t count;
+	int error, i, maxheralds, maxstreams, sd;
+
+	if (strcmp(cmd, "herald") != 0)
+		return (EINVAL);
+
+	sd = nvlist_get_descriptor(limits, "socket");
+	herald_pool_init((int)MIN(dnvlist_get_number(limits, "poolsize", 0),
+	    NETDUMP_HERALD_POOL_MAX));
+	maxstreams = (int)MIN(dnvlist_get_number(nvlin, "maxstreams", 1),
+	    NETDUMP_STREAMS_MAX);
+	maxheralds = (int)MIN(MAX(dnvlist_get_number(nvlin, "maxheralds", 1),
+	    1), NETDUMP_HERALDS_MAX);
+
+	error = 0;
+	count = 0;
+	for (i = 0; i < maxheralds; i++) {
+		nvl = nvlist_create(0);
+		error = herald_recv(sd, maxstreams, nvl);
+		if (error != 0) {
+			nvlist_destroy(nvl);
+			if (error == EINVAL)
+				continue;
+			break;
+		}
+		snprintf(name, sizeof(name), "herald%ju", (uintmax_t)count);
+		nvlist_move_nvlist(nvlout, name, nvl);
+		count++;
+	}
+
+	/*
+	 * Running out of messages is how a batch normally ends, and junk is
+	 * not worth reporting, so an error is only returned if one stopped us
+	 * from answering any herald.
+	 */
+	if (count == 0 && error != 0 && error != EINVAL && error != EAGAIN &&
+	    error != EWOULDBLOCK)
+		return (error);
+	nvlist_add_number(nvlout, "count", count);
+	return (0);
 }
 
 static int
@@ -221,6 +510,9 @@ herald_limit(const nvlist_t *oldlimits, const nvlist_t *newlimits)
 	while ((name = nvlist_next(newlimits, &nvtype, &cookie)) != NULL) {
 		if (nvtype == NV_TYPE_DESCRIPTOR && strcmp(name, "socket") == 0)
 			hassock = true;
+		else if (nvtype == NV_TYPE_NUMBER &&
+		    strcmp(name, "poolsize") == 0)
+			continue;
 		else
 			return (EINVAL);
 	}
@@ -23,29 +23,134 @@
  * SUCH DAMAGE.
  */
 
-#include <sys/types.h>
+#include <sys/param.h>
 #include <sys/endian.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/netdump/netdump.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "netdumpd.h"
+
+/*
+ * Besides exercising the protocol, the sender is used to measure the server.
+ * Each run prints MB/s, packets and ACKs per second, retransmissions and ACK
+ * latency percentiles.
+ *
+ *   netdump-client -w -l 5 <file>
+ *   netdump-client -w -S -l 5 <file>
+ *	Recovery from 0.5% loss by timeouts alone, and with selective ACKs.
+ *	With SACKs, retransmissions should stay close to the packets dropped;
+ *	without them, each timeout resends every outstanding packet. Compare
+ *	both with a run without -l.
+ *
+ *   netdump-client -w -m 8 <file>
+ *	Striping over up to 8 server sockets, against netdumpd -m 8 with -t set
+ *	to the number of cores, from another host through an RSS-capable NIC.
+ *	MB/s should scale with -m until the disk or the sender is the limit;
+ *	compare with -m 1, 2 and 4, and watch per-thread CPU with top -H.
+ */
+
+#define	MAX_OUTSTANDING	1024	/* Unacknowledged packets when windowed. */
+#define	DEFAULT_INFLIGHT 64	/* Packets in flight without a window. */
+#define	RETX_TIMEOUT_MS	200	/* Retransmission timeout. */
+#define	DEFAULT_ACKUSEC	2000	/* Longest ACK delay requested. */
+#define	DUPACK_THRESH	3	/* Repeated cumulative ACKs hinting at a loss. */
+#define	HERALD_TIMEOUT_MS 1000	/* Herald retransmission timeout. */
+#define	LATENCY_BUCKETS	32	/* ACK latency histogram. */
+
+/*
+ * Windowed sender state, kept for each stream. Outstanding packets are tracked
+ * in a ring indexed by seqno, so that the window is only charged once for each
+ * ACKed packet, and lost packets can be read back from the file and
+ * retransmitted.
+ */
+struct stream {
+	struct sockaddr_in sin;		/* Server address and port. */
+	uint32_t	seqno;		/* Last seqno used. */
+	uint32_t	lastack;
+	int		dupacks;	/* Times lastack was repeated. */
+	uint32_t	window;		/* In bytes. */
+	uint64_t	inflight;	/* Unacknowledged payload bytes. */
+	int		npkts;		/* Unacknowledged packets. */
+	uint32_t	una;		/* Oldest unacknowledged seqno. */
+	uint32_t	next;		/* Next seqno to be sent. */
+	struct {
+		uint32_t	seqno;
+		uint32_t	len;	/* 0 once ACKed. */
+		uint32_t	wlen;	/* Sent payload, maybe compressed. */
+		uint64_t	off;
+		bool		retx;	/* Retransmitted already. */
+		struct timespec	sent;
+	} pkts[MAX_OUTSTANDING];
+
+	/* Parity of the group being sent. */
+	struct netdump_msg_hdr *fec;	/* Header, netdump_fec and payload. */
+	uint32_t	fec_first;	/* First seqno covered. */
+	uint32_t	fec_count;	/* Messages covered. */
+	uint32_t	fec_maxlen;	/* Longest payload covered. */
+};
+
+struct flow {
+	int		sd;
+	int		fd;		/* The file being sent. */
+	struct netdump_msg_hdr *rbuf;	/* Retransmission buffer. */
+	bool		advwin;		/* The server advertises a window. */
+	bool		sack;		/* The server lists received ranges. */
+	bool		cumack;		/* ACKs are cumulative. */
+	int		loss;		/* Packets dropped, per thousand. */
+	uint32_t	stripe;		/* Bytes sent on a stream in a row. */
+	uint32_t	fecgroup;	/* Seqnos per parity group, or 0. */
+	int		nstreams;
+	struct stream	streams[NETDUMP_STREAMS_MAX];
+
+	/* Statistics. */
+	uint64_t	nretx;
+	uint64_t	nsackretx;	/* Retransmissions prompted by SACKs. */
+	uint64_t	ndropped;
+	uint64_t	nacks;		/* ACKs received. */
+	uint64_t	nsent;		/* VMCORE packets sent. */
+	uint64_t	nparity;	/* Parity packets sent. */
+};
+
+/*
+ * Time from sending a packet to its ACK, in microseconds. Bucket i counts
+ * latencies below 2^i us. Retransmitted packets are left out, since their ACK
+ * may be for either copy.
+ */
+static uint64_t lat_hist[LATENCY_BUCKETS];
+static uint64_t lat_count;
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: %s [-c <addr>] [-p <path>] <file>\n",
-	    getprogname());
+	fprintf(stderr,
+	    "usage: %s [-Sw] [-a <ackpkts>] [-b <srcaddr>] [-c <addr>]\n"
+	    "       [-f <group>] [-j <dumps>] [-l <loss>] [-m <streams>]\n"
+	    "       [-p <path>] [-r <token>] [-s <datasize>] [-t <ackusec>] [-z]\n"
+	    "       <file>\n"
+	    "       %s -H <heralds> [-k] [-b <srcaddr>] [-c <addr>] [-n <hosts>]\n",
+	    getprogname(), getprogname());
 	exit(1);
 }
 
@@ -74,31 +179,682 @@ waitack(int sd, uint32_t seqno)
 		warnx("unexpected seqno %u, wanted %u", got, seqno);
 }
 
+/*
+ * Send the file as several concurrent dumps, from consecutive source addresses
+ * starting at the one given, since the server tells dumps apart by address.
+ * Each dump is sent by a child process, which returns to carry it out, and
+ * reports its own throughput; the parent reports the aggregate.
+ */
+static void
+spawn_dumps(int ndumps, struct in_addr *srcaddr, const char *file)
+{
+	struct stat sb;
+	struct timespec end, start;
+	double secs;
+	pid_t pid;
+	int i, nfailed, status;
+
+	if (stat(file, &sb) != 0)
+		err(1, "failed to stat %s", file);
+	(void)fflush(stdout);
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ndumps; i++) {
+		pid = fork();
+		if (pid < 0)
+			err(1, "fork");
+		if (pid == 0) {
+			srcaddr->s_addr = htonl(ntohl(srcaddr->s_addr) + i);
+			return;
+		}
+	}
+	nfailed = 0;
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			nfailed++;
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = MAX(end.tv_sec - start.tv_sec +
+	    (end.tv_nsec - start.tv_nsec) / 1e9, 1e-9);
+	printf("%d dumps, %jd bytes in %.3f s (%.2f MB/s), %d failed\n",
+	    ndumps, (intmax_t)sb.st_size * ndumps, secs,
+	    sb.st_size * ndumps / secs / (1024 * 1024), nfailed);
+	exit(nfailed != 0);
+}
+
+static void
+lat_add(int64_t usec)
+{
+	int b;
+
+	b = usec > 0 ? flsll(usec) : 0;
+	lat_hist[MIN(b, LATENCY_BUCKETS - 1)]++;
+	lat_count++;
+}
+
+static void
+lat_record(const struct timespec *sent)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	lat_add((now.tv_sec - sent->tv_sec) * 1000000 +
+	    (now.tv_nsec - sent->tv_nsec) / 1000);
+}
+
+/* Return an upper bound of the given percentile of the latencies recorded. */
+static uint64_t
+lat_pct(int pct)
+{
+	uint64_t cum, target;
+	int b;
+
+	target = (lat_count * pct + 99) / 100;
+	cum = 0;
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+		cum += lat_hist[b];
+		if (cum >= target)
+			break;
+	}
+	return ((uint64_t)1 << b);
+}
+
+static void
+lat_report(const char *what)
+{
+
+	if (lat_count == 0)
+		return;
+	printf("%s latency: p50 %ju us, p90 %ju us, p99 %ju us (%ju samples)\n",
+	    what, (uintmax_t)lat_pct(50), (uintmax_t)lat_pct(90),
+	    (uintmax_t)lat_pct(99), (uintmax_t)lat_count);
+}
+
+/*
+ * Receive a herald ACK, returning the time it arrived at the socket in ts, so
+ * that ACKs queued while others are read are not charged for the wait.
+ */
+static ssize_t
+recv_herald_ack(int sd, struct netdump_ack *ack, struct sockaddr_in *from,
+    struct timeval *ts)
+{
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(struct timeval))];
+	} cmsgbuf;
+	ssize_t r;
+
+	iov.iov_base = ack;
+	iov.iov_len = sizeof(*ack);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof(*from);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	r = recvmsg(sd, &msg, 0);
+	if (r < 0)
+		return (r);
+	(void)gettimeofday(ts, NULL);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMP)
+			memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+	}
+	return (r);
+}
+
+/* Finish the dumps started by the hosts' heralds. */
+static void
+herald_bench_finish(const int *sds, const struct sockaddr_in *dumps, int n)
+{
+	struct netdump_ack ack;
+	struct netdump_msg_hdr ndmsg;
+	int i;
+
+	memset(&ndmsg, 0, sizeof(ndmsg));
+	ndmsg.mh_type = htonl(NETDUMP_FINISHED);
+	for (i = 0; i < n; i++)
+		if (dumps[i].sin_port != 0)
+			sendndmsg(sds[i], &dumps[i], &ndmsg);
+	for (i = 0; i < n; i++)
+		if (dumps[i].sin_port != 0)
+			(void)recv(sds[i], &ack, sizeof(ack), 0);
+}
+
+/*
+ * Measure how fast the server answers bursts of heralds, and how long each
+ * herald waits for its ACK. Each round sends a herald from every host back to
+ * back, waits for their ACKs, and finishes the empty dumps they started so
+ * that the next round starts new ones. Hosts are consecutive source addresses
+ * starting at srcaddr, which must be configured locally, since the server
+ * tells dumps apart by address.
+ *
+ * If keep is set, the dumps are only finished at the end. The first round
+ * fills the server's client table, and the heralds of later rounds are
+ * answered as retransmits, which costs little more than looking up the host's
+ * dump among all the others.
+ */
+static void
+herald_bench(const struct sockaddr_in *server, struct in_addr srcaddr,
+    int nheralds, int nhosts, bool keep)
+{
+	struct netdump_ack ack;
+	struct netdump_msg_hdr ndmsg;
+	struct sockaddr_in from, sin, *dumps;
+	struct timespec end, start;
+	struct timeval rcvd, *sent, tv;
+	double secs;
+	uint64_t nlost, nsent;
+	ssize_t r;
+	int i, n, on, *sds;
+
+	sds = calloc(nhosts, sizeof(*sds));
+	dumps = calloc(nhosts, sizeof(*dumps));
+	sent = calloc(nhosts, sizeof(*sent));
+	if (sds == NULL || dumps == NULL || sent == NULL)
+		err(1, "calloc");
+	on = 1;
+	tv.tv_sec = HERALD_TIMEOUT_MS / 1000;
+	tv.tv_usec = HERALD_TIMEOUT_MS % 1000 * 1000;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_len = sizeof(sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(NETDUMP_ACKPORT);
+	for (i = 0; i < nhosts; i++) {
+		sds[i] = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (sds[i] < 0)
+			err(1, "socket");
+		sin.sin_addr.s_addr = srcaddr.s_addr == INADDR_ANY ?
+		    INADDR_ANY : htonl(ntohl(srcaddr.s_addr) + i);
+		if (bind(sds[i], (struct sockaddr *)&sin, sizeof(sin)) != 0)
+			err(1, "bind(%s)", inet_ntoa(sin.sin_addr));
+		if (setsockopt(sds[i], SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) != 0 ||
+		    setsockopt(sds[i], SOL_SOCKET, SO_TIMESTAMP, &on,
+		    sizeof(on)) != 0)
+			err(1, "setsockopt");
+	}
+
+	memset(&ndmsg, 0, sizeof(ndmsg));
+	nlost = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	ndmsg.mh_type = htonl(NETDUMP_HERALD);
+	for (nsent = 0; nsent < (uint64_t)nheralds; nsent += n) {
+		n = (int)MIN((uint64_t)nhosts, nheralds - nsent);
+		for (i = 0; i < n; i++) {
+			(void)gettimeofday(&sent[i], NULL);
+			sendndmsg(sds[i], server, &ndmsg);
+		}
+		for (i = 0; i < n; i++) {
+			r = recv_herald_ack(sds[i], &ack, &from, &rcvd);
+			if (r < (ssize_t)sizeof(ack)) {
+				/* A kept dump's port is still known. */
+				if (!keep)
+					dumps[i].sin_port = 0;
+				nlost++;
+				continue;
+			}
+			dumps[i] = from;
+			lat_add((rcvd.tv_sec - sent[i].tv_sec) * 1000000 +
+			    rcvd.tv_usec - sent[i].tv_usec);
+		}
+
+		if (!keep)
+			herald_bench_finish(sds, dumps, n);
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	if (keep)
+		herald_bench_finish(sds, dumps, nhosts);
+	secs = MAX(end.tv_sec - start.tv_sec +
+	    (end.tv_nsec - start.tv_nsec) / 1e9, 1e-9);
+	printf("%ju heralds from %d hosts in %.3f s (%.0f heralds/s), "
+	    "%ju unanswered\n", (uintmax_t)nsent, nhosts, secs, nsent / secs,
+	    (uintmax_t)nlost);
+	lat_report("Herald ACK");
+
+	for (i = 0; i < nhosts; i++)
+		(void)close(sds[i]);
+	free(sds);
+	free(dumps);
+	free(sent);
+}
+
+/* Decide whether to drop a packet to simulate a loss. */
+static bool
+flow_lost(struct flow *fl)
+{
+
+	if (fl->loss > 0 && (int)arc4random_uniform(1000) < fl->loss) {
+		fl->ndropped++;
+		return (true);
+	}
+	return (false);
+}
+
+/* Send a VMCORE packet, unless it is picked to simulate a loss. */
+static void
+flow_xmit(struct flow *fl, struct stream *st,
+    const struct netdump_msg_hdr *ndmsg)
+{
+
+	if (flow_lost(fl))
+		return;
+	sendndmsg(fl->sd, &st->sin, ndmsg);
+	fl->nsent++;
+}
+
+/* Send the parity of the messages covered so far, and start afresh. */
+static void
+flow_fec_flush(struct flow *fl, struct stream *st)
+{
+	struct netdump_fec *nf;
+
+	if (st->fec_count == 0)
+		return;
+	nf = (struct netdump_fec *)(void *)(st->fec + 1);
+	st->fec->mh_type = htonl(NETDUMP_PARITY);
+	st->fec->mh_seqno = htonl(st->fec_first);
+	st->fec->mh_len = htonl(sizeof(*nf) + st->fec_maxlen);
+	nf->nf_count = htonl(st->fec_count);
+	if (!flow_lost(fl))
+		sendndmsg(fl->sd, &st->sin, st->fec);
+	fl->nparity++;
+
+	memset(nf, 0, sizeof(*nf) + st->fec_maxlen);
+	st->fec_count = st->fec_maxlen = 0;
+}
+
+/*
+ * Fold a newly sent VMCORE packet into the parity of its group, sending the
+ * parity once the group is complete.
+ */
+static void
+flow_fec(struct flow *fl, struct stream *st,
+    const struct netdump_msg_hdr *ndmsg)
+{
+	struct netdump_fec *nf;
+	const uint8_t *src;
+	uint8_t *dst;
+	uint32_t i, len, seqno;
+
+	seqno = ntohl(ndmsg->mh_seqno);
+	len = ntohl(ndmsg->mh_len);
+	nf = (struct netdump_fec *)(void *)(st->fec + 1);
+	if (st->fec_count++ == 0)
+		st->fec_first = seqno;
+	st->fec_maxlen = MAX(st->fec_maxlen, len);
+	nf->nf_offset ^= ndmsg->mh_offset;
+	nf->nf_len ^= ndmsg->mh_len;
+	src = (const uint8_t *)(ndmsg + 1);
+	dst = (uint8_t *)(nf + 1);
+	for (i = 0; i < len; i++)
+		dst[i] ^= src[i];
+	if ((seqno + 1) % fl->fecgroup == 0)
+		flow_fec_flush(fl, st);
+}
+
+/* Read an outstanding packet back from the file and send it again. */
+static void
+flow_retransmit(struct flow *fl, struct stream *st, int slot)
+{
+	ssize_t n;
+
+	n = pread(fl->fd, fl->rbuf + 1, st->pkts[slot].len, st->pkts[slot].off);
+	if (n != (ssize_t)st->pkts[slot].len)
+		err(1, "pread");
+	fl->rbuf->mh_type = htonl(NETDUMP_VMCORE);
+	fl->rbuf->mh_seqno = htonl(st->pkts[slot].seqno);
+	fl->rbuf->mh_offset = htobe64(st->pkts[slot].off);
+	fl->rbuf->mh_len = htonl(st->pkts[slot].len);
+	flow_xmit(fl, st, fl->rbuf);
+	st->pkts[slot].retx = true;
+	fl->nretx++;
+}
+
+/* Mark an outstanding packet as acknowledged. */
+static void
+flow_acked(struct stream *st, uint32_t seqno)
+{
+	int slot;
+
+	slot = seqno % MAX_OUTSTANDING;
+	if (st->pkts[slot].seqno != seqno || st->pkts[slot].len == 0)
+		return;
+	if (!st->pkts[slot].retx)
+		lat_record(&st->pkts[slot].sent);
+	st->inflight -= st->pkts[slot].wlen;
+	st->pkts[slot].len = 0;
+	st->npkts--;
+	while (st->una != st->next && st->pkts[st->una % MAX_OUTSTANDING].len == 0)
+		st->una++;
+}
+
+/*
+ * Process the ranges listed in a SACK. Outstanding packets within a range
+ * were received even if their ACK was lost. Those ending before the last range
+ * but not within any were lost, and are retransmitted once; if that copy is
+ * lost too, the retransmission timeout recovers it.
+ */
+static void
+flow_sack(struct flow *fl, struct stream *st, const struct netdump_ack_ext *ack,
+    size_t len)
+{
+	uint64_t end, hi, off;
+	uint32_t nsacks, seqno;
+	int i, slot;
+	bool covered;
+
+	if (len < offsetof(struct netdump_ack_ext, na_sacks))
+		return;
+	nsacks = MIN(ntohl(ack->na_nsacks), (len -
+	    offsetof(struct netdump_ack_ext, na_sacks)) /
+	    sizeof(ack->na_sacks[0]));
+	if (nsacks == 0)
+		return;
+	hi = be64toh(ack->na_sacks[nsacks - 1].ns_end);
+
+	for (seqno = st->una; seqno != st->next; seqno++) {
+		slot = seqno % MAX_OUTSTANDING;
+		if (st->pkts[slot].len == 0)
+			continue;
+		off = st->pkts[slot].off;
+		end = off + st->pkts[slot].len;
+		covered = false;
+		for (i = 0; i < (int)nsacks && !covered; i++)
+			covered = be64toh(ack->na_sacks[i].ns_start) <= off &&
+			    end <= be64toh(ack->na_sacks[i].ns_end);
+		if (covered)
+			flow_acked(st, seqno);
+		else if (end <= hi && !st->pkts[slot].retx) {
+			flow_retransmit(fl, st, slot);
+			fl->nsackretx++;
+		}
+	}
+}
+
+/*
+ * Wait for an ACK, and update the window of the stream it came from. If none
+ * arrives in time, every outstanding packet is retransmitted.
+ */
+static void
+flow_recvack(struct flow *fl)
+{
+	struct netdump_ack_ext ack;
+	struct sockaddr_in from;
+	struct stream *st;
+	socklen_t fromlen;
+	uint32_t seqno;
+	ssize_t n;
+	int i, slot;
+
+	fromlen = sizeof(from);
+	n = recvfrom(fl->sd, &ack, sizeof(ack), 0, (struct sockaddr *)&from,
+	    &fromlen);
+	if (n < 0 && errno == EAGAIN) {
+		for (i = 0; i < fl->nstreams; i++) {
+			st = &fl->streams[i];
+			for (seqno = st->una; seqno != st->next; seqno++) {
+				slot = seqno % MAX_OUTSTANDING;
+				if (st->pkts[slot].len != 0)
+					flow_retransmit(fl, st, slot);
+			}
+		}
+		return;
+	}
+	if (n < (ssize_t)offsetof(struct netdump_ack_ext, na_nsacks))
+		err(1, "recv");
+	for (i = 0; i < fl->nstreams; i++)
+		if (fl->streams[i].sin.sin_port == from.sin_port)
+			break;
+	if (i == fl->nstreams)
+		return;
+	st = &fl->streams[i];
+
+	fl->nacks++;
+	seqno = ntohl(ack.na_seqno);
+	if (fl->advwin)
+		st->window = ntohl(ack.na_window);
+	if (fl->cumack) {
+		/*
+		 * The server acknowledges at once a packet arriving after a
+		 * gap, so a repeated ACK suggests the next packet was lost.
+		 */
+		if (seqno == st->lastack && st->npkts > 0) {
+			slot = st->una % MAX_OUTSTANDING;
+			if (++st->dupacks == DUPACK_THRESH &&
+			    !st->pkts[slot].retx)
+				flow_retransmit(fl, st, slot);
+		} else
+			st->dupacks = 0;
+		st->lastack = seqno;
+		while (st->npkts > 0 && (int32_t)(seqno - st->una) >= 0)
+			flow_acked(st, st->una);
+	} else
+		flow_acked(st, seqno);
+	if (fl->sack)
+		flow_sack(fl, st, &ack, n);
+}
+
+/*
+ * Send a packet holding rawlen bytes of the file on the stream its offset is
+ * striped to, once the stream's window has room for it. With nothing in
+ * flight, a window too small for the packet is reopened by the server repeating
+ * its last ACK. Retransmissions are sent uncompressed.
+ */
+static void
+flow_send(struct flow *fl, struct netdump_msg_hdr *ndmsg, uint32_t rawlen)
+{
+	struct stream *st;
+	uint64_t off;
+	uint32_t len, seqno;
+	int slot;
+
+	off = be64toh(ndmsg->mh_offset);
+	st = &fl->streams[(off / fl->stripe) % fl->nstreams];
+	len = ntohl(ndmsg->mh_len);
+	while (st->npkts == MAX_OUTSTANDING ||
+	    (st->npkts > 0 && st->inflight + len > st->window) ||
+	    (st->npkts == 0 && len > st->window))
+		flow_recvack(fl);
+	seqno = ++st->seqno;
+	ndmsg->mh_seqno = htonl(seqno);
+	if (st->npkts == 0)
+		st->una = seqno;
+	st->next = seqno + 1;
+	slot = seqno % MAX_OUTSTANDING;
+	st->pkts[slot].seqno = seqno;
+	st->pkts[slot].len = rawlen;
+	st->pkts[slot].wlen = len;
+	st->pkts[slot].off = off;
+	st->pkts[slot].retx = false;
+	(void)clock_gettime(CLOCK_MONOTONIC, &st->pkts[slot].sent);
+	st->inflight += len;
+	st->npkts++;
+	flow_xmit(fl, st, ndmsg);
+	if (fl->fecgroup != 0)
+		flow_fec(fl, st, ndmsg);
+}
+
+/* Return true if a packet sent on any stream is still unacknowledged. */
+static bool
+flow_outstanding(const struct flow *fl)
+{
+	int i;
+
+	for (i = 0; i < fl->nstreams; i++)
+		if (fl->streams[i].npkts > 0)
+			return (true);
+	return (false);
+}
+
+/*
+ * Send the FINISHED message on the first stream once everything has been
+ * acknowledged, and wait for its own ACK, skipping late ACKs for retransmitted
+ * packets.
+ */
+static void
+flow_finish(struct flow *fl)
+{
+	struct netdump_ack_ext ack;
+	struct netdump_msg_hdr ndmsg;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	ssize_t n;
+	int i;
+
+	if (fl->fecgroup != 0)
+		for (i = 0; i < fl->nstreams; i++)
+			flow_fec_flush(fl, &fl->streams[i]);
+	while (flow_outstanding(fl))
+		flow_recvack(fl);
+
+	memset(&ndmsg, 0, sizeof(ndmsg));
+	ndmsg.mh_type = htonl(NETDUMP_FINISHED);
+	sendndmsg(fl->sd, &fl->streams[0].sin, &ndmsg);
+	for (;;) {
+		fromlen = sizeof(from);
+		n = recvfrom(fl->sd, &ack, sizeof(ack), 0,
+		    (struct sockaddr *)&from, &fromlen);
+		if (n < 0 && errno == EAGAIN) {
+			sendndmsg(fl->sd, &fl->streams[0].sin, &ndmsg);
+			continue;
+		}
+		if (n < (ssize_t)sizeof(struct netdump_ack))
+			err(1, "recv");
+		if (ntohl(ack.na_seqno) == 0 &&
+		    from.sin_port == fl->streams[0].sin.sin_port)
+			break;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	char buf[BUFSIZ];
 	struct addrinfo hints, *res;
+	struct flow *fl;
+	struct stream *st;
 	struct msghdr msg;
-	struct netdump_ack ack;
-	struct netdump_msg_hdr ndmsg, *ndmsgp;
-	struct sockaddr_in sin;
+	struct netdump_herald_ack hack;
+	struct netdump_herald_ext ext;
+	struct netdump_msg_hdr ndmsg, *ndmsgp, *sndmsg, *zmsg;
+	struct sockaddr_in hsin, sin;
+	struct in_addr srcaddr;
 	struct stat sb;
-	char *addr, *path;
-	ssize_t off, r;
-	size_t pathsz;
-	uint32_t seqno;
-	int ch, error, fd, sd;
+	struct timespec end, sent, start;
+	struct timeval tv;
+	const char *errstr;
+	char *addr, *buf, *path, *zbuf;
+	double secs;
+	ssize_t n, off, r, resumeoff;
+	size_t chunk, clen, extsz, len, pathsz;
+	uint64_t token, wirebytes;
+	uint32_t ackpkts, ackusec, datasize, fecgroup, flags, seqno;
+	int ch, error, fd, i, loss, ndumps, nheralds, nhosts, nstreams, sd;
+	bool keep, lz4, sack, windowed;
 
 	addr = path = NULL;
-	while ((ch = getopt(argc, argv, "c:p:")) != -1) {
+	ackpkts = datasize = fecgroup = 0;
+	ackusec = DEFAULT_ACKUSEC;
+	loss = 0;
+	ndumps = nhosts = nstreams = 1;
+	nheralds = 0;
+	srcaddr.s_addr = INADDR_ANY;
+	token = 0;
+	keep = lz4 = sack = windowed = false;
+	while ((ch = getopt(argc, argv, "a:b:c:f:H:j:kl:m:n:p:r:Ss:t:wz")) != -1) {
 		switch (ch) {
+		case 'a':
+			ackpkts = (uint32_t)strtonum(optarg, 2, UINT16_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "packets per ACK is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'b':
+			if (inet_pton(AF_INET, optarg, &srcaddr) != 1)
+				errx(1, "invalid source address '%s'", optarg);
+			break;
 		case 'c':
 			addr = strdup(optarg);
 			break;
+		case 'f':
+			fecgroup = (uint32_t)strtonum(optarg, 2,
+			    NETDUMP_FEC_GROUP_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "parity group size is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'H':
+			nheralds = (int)strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "herald count is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'j':
+			ndumps = (int)strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "dump count is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'l':
+			loss = (int)strtonum(optarg, 0, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "loss rate is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'm':
+			nstreams = (int)strtonum(optarg, 1,
+			    NETDUMP_STREAMS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "stream count is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'n':
+			nhosts = (int)strtonum(optarg, 1, 65536, &errstr);
+			if (errstr != NULL)
+				errx(1, "host count is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'S':
+			sack = true;
+			break;
 		case 'p':
 			path = strdup(optarg);
 			break;
+		case 'r':
+			token = (uint64_t)strtonum(optarg, 1, LLONG_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "dump token is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 's':
+			datasize = (uint32_t)strtonum(optarg, NETDUMP_DATASIZE,
+			    NETDUMP_DATASIZE_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "payload size is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 't':
+			ackusec = (uint32_t)strtonum(optarg, 1, 1000000,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "ACK delay is %s: '%s'", errstr,
+				    optarg);
+			break;
+		case 'w':
+			windowed = true;
+			break;
+		case 'z':
+			lz4 = true;
+			break;
 		default:
 			usage();
 		}
@@ -106,8 +862,21 @@ main(int argc, char **argv)
 
 	argc -= optind;
 	argv += optind;
-	if (argc != 1)
+	if (argc != (nheralds == 0 ? 1 : 0))
 		usage();
+	if (nheralds != 0 && ndumps > 1)
+		errx(1, "-H and -j are mutually exclusive");
+	if (nhosts > 1 && (nheralds == 0 || srcaddr.s_addr == INADDR_ANY))
+		errx(1, "-n requires -H and -b");
+	/* Losses are only recovered from by the windowed sender. */
+	if (loss != 0 && !sack && !windowed && ackpkts == 0 && fecgroup == 0 &&
+	    nstreams == 1)
+		errx(1, "-l requires -a, -f, -m, -S or -w");
+	if (ndumps > 1) {
+		if (srcaddr.s_addr == INADDR_ANY)
+			errx(1, "-j requires -b");
+		spawn_dumps(ndumps, &srcaddr, argv[0]);
+	}
 
 	if (addr == NULL)
 		addr = strdup("127.0.0.1");
@@ -120,6 +889,19 @@ main(int argc, char **argv)
 	if (res == NULL || res->ai_addr->sa_family != AF_INET)
 		errx(1, "failed to look up '%s'", addr);
 
+	if (nheralds != 0) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_len = sizeof(sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(NETDUMP_PORT);
+		sin.sin_addr =
+		    ((struct sockaddr_in *)(void *)res->ai_addr)->sin_addr;
+		herald_bench(&sin, srcaddr, nheralds, nhosts, keep);
+		free(addr);
+		free(path);
+		return (0);
+	}
+
 	fd = open(argv[0], O_RDONLY);
 	if (fd < 0)
 		err(1, "opening %s", argv[0]);
@@ -136,7 +918,7 @@ main(int argc, char **argv)
 	sin.sin_len = sizeof(sin);
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(NETDUMP_ACKPORT);
-	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_addr = srcaddr;
 	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
 		err(1, "bind");
 
@@ -146,16 +928,67 @@ main(int argc, char **argv)
 	if (sin.sin_addr.s_addr == INADDR_NONE)
 		errx(1, "invalid address '%s'", addr);
 
-	pathsz = (path != NULL ? strlen(path) + 1 : 0);
-	ndmsgp = malloc(sizeof(*ndmsgp) + pathsz);
+	/*
+	 * Protocol extensions follow the path in the herald, so the path is
+	 * sent, possibly empty, whenever an extension is requested.
+	 */
+	memset(&ext, 0, sizeof(ext));
+	flags = 0;
+	if (datasize != 0) {
+		flags |= NETDUMP_EXT_DATASIZE;
+		ext.nhe_datasize = htonl(datasize);
+	}
+	if (windowed)
+		flags |= NETDUMP_EXT_WINDOW;
+	if (sack)
+		flags |= NETDUMP_EXT_SACK;
+	if (ackpkts != 0) {
+		flags |= NETDUMP_EXT_DELACK;
+		ext.nhe_ackpkts = htonl(ackpkts);
+		ext.nhe_ackusec = htonl(ackusec);
+	}
+	if (nstreams > 1) {
+		flags |= NETDUMP_EXT_STREAMS;
+		ext.nhe_nstreams = htonl(nstreams);
+	}
+	if (fecgroup != 0) {
+		flags |= NETDUMP_EXT_FEC;
+		ext.nhe_fecgroup = htonl(fecgroup);
+	}
+	if (token != 0) {
+		flags |= NETDUMP_EXT_RESUME;
+		ext.nhe_token = htobe64(token);
+	}
+	if (lz4)
+		flags |= NETDUMP_EXT_LZ4;
+	if (flags != 0) {
+		ext.nhe_magic = htonl(NETDUMP_EXT_MAGIC);
+		ext.nhe_flags = htonl(flags);
+	}
+	extsz = ext.nhe_magic != 0 ? sizeof(ext) : 0;
+	pathsz = path != NULL ? strlen(path) + 1 : (extsz != 0 ? 1 : 0);
+	ndmsgp = calloc(1, sizeof(*ndmsgp) + pathsz + extsz);
 	if (ndmsgp == NULL)
-		err(1, "malloc");
-	memset(ndmsgp, 0, sizeof(*ndmsgp));
+		err(1, "calloc");
 	ndmsgp->mh_type = htonl(NETDUMP_HERALD);
-	ndmsgp->mh_len = htonl((uint32_t)pathsz);
+	ndmsgp->mh_len = htonl((uint32_t)(pathsz + extsz));
 	if (path != NULL)
 		strcpy((char *)(ndmsgp + 1), path);
-	sendndmsg(sd, &sin, ndmsgp);
+	memcpy((char *)(ndmsgp + 1) + pathsz, &ext, extsz);
+	hsin = sin;
+	sendndmsg(sd, &hsin, ndmsgp);
+
+	/*
+	 * A server resuming a dump may only answer once it has saved the state
+	 * of the dump, so the herald is retransmitted until it is.
+	 */
+	if (token != 0) {
+		tv.tv_sec = HERALD_TIMEOUT_MS / 1000;
+		tv.tv_usec = HERALD_TIMEOUT_MS % 1000 * 1000;
+		if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) != 0)
+			err(1, "setsockopt");
+	}
 
 	/*
 	 * The server uses the first ACK to tell us which port it'll use for the
@@ -164,35 +997,248 @@ main(int argc, char **argv)
 	 */
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name = &sin;
-	msg.msg_namelen = sizeof(sin);
 	msg.msg_iov = malloc(sizeof(*msg.msg_iov));
-	msg.msg_iov[0].iov_base = &ack;
-	msg.msg_iov[0].iov_len = sizeof(ack);
+	msg.msg_iov[0].iov_base = &hack;
+	msg.msg_iov[0].iov_len = sizeof(hack);
 	msg.msg_iovlen = 1;
-	if (recvmsg(sd, &msg, 0) != sizeof(ack))
+	for (;;) {
+		msg.msg_namelen = sizeof(sin);
+		n = recvmsg(sd, &msg, 0);
+		if (n >= 0 || errno != EAGAIN)
+			break;
+		sendndmsg(sd, &hsin, ndmsgp);
+	}
+	free(ndmsgp);
+	if (n < 0)
 		err(1, "recvmsg");
-	seqno = ack.na_seqno;
+	if (token != 0) {
+		timerclear(&tv);
+		if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) != 0)
+			err(1, "setsockopt");
+	}
+	if (n < (ssize_t)sizeof(struct netdump_ack))
+		errx(1, "unexpected herald ACK size %zd", n);
+	if ((size_t)n < sizeof(hack))
+		memset((char *)&hack + n, 0, sizeof(hack) - n);
+	seqno = ntohl(hack.nha_seqno);
+
+	/*
+	 * A server that doesn't know about extensions replies with a plain
+	 * ACK, in which case we stick to the default payload size and wait for
+	 * each packet to be acknowledged.
+	 */
+	flags = 0;
+	if (ntohl(hack.nha_magic) == NETDUMP_EXT_MAGIC)
+		flags = ntohl(hack.nha_flags);
+	chunk = BUFSIZ - sizeof(*ndmsgp);
+	if (datasize != 0) {
+		chunk = NETDUMP_DATASIZE;
+		if ((flags & NETDUMP_EXT_DATASIZE) != 0)
+			chunk = MIN(datasize, ntohl(hack.nha_datasize));
+		printf("Using %zu-byte payloads\n", chunk);
+	}
+	if (windowed && (flags & NETDUMP_EXT_WINDOW) == 0)
+		printf("Server does not advertise a window\n");
+	if (sack && (flags & NETDUMP_EXT_SACK) == 0)
+		printf("Server does not send selective ACKs\n");
+	if (ackpkts != 0) {
+		if ((flags & NETDUMP_EXT_DELACK) != 0)
+			printf("Delayed ACKs every %u packets or %u us\n",
+			    ntohl(hack.nha_ackpkts), ntohl(hack.nha_ackusec));
+		else
+			printf("Server does not delay ACKs\n");
+	}
+	if (nstreams > 1) {
+		if ((flags & NETDUMP_EXT_STREAMS) != 0) {
+			nstreams = MIN(ntohl(hack.nha_nstreams),
+			    NETDUMP_STREAMS_MAX);
+			printf("Striping over %d streams in %u-byte units\n",
+			    nstreams, ntohl(hack.nha_stripe));
+		} else {
+			nstreams = 1;
+			printf("Server does not stripe over several streams\n");
+		}
+	}
+	if (fecgroup != 0) {
+		if ((flags & NETDUMP_EXT_FEC) != 0) {
+			/* Parity must fit in a payload. */
+			fecgroup = ntohl(hack.nha_fecgroup);
+			chunk = MIN(chunk, NETDUMP_DATASIZE);
+			if ((flags & NETDUMP_EXT_DATASIZE) != 0)
+				chunk = MIN(datasize, ntohl(hack.nha_datasize));
+			chunk -= sizeof(struct netdump_fec);
+			printf("Parity every %u packets, %zu-byte payloads\n",
+			    fecgroup, chunk);
+		} else {
+			fecgroup = 0;
+			printf("Server does not send parity\n");
+		}
+	}
+	resumeoff = 0;
+	if (token != 0) {
+		if ((flags & NETDUMP_EXT_RESUME) != 0) {
+			resumeoff = (ssize_t)MIN(be64toh(hack.nha_resumeoff),
+			    (uint64_t)sb.st_size);
+			if (resumeoff != 0)
+				printf("Resuming at offset %zd\n", resumeoff);
+			if (lseek(fd, resumeoff, SEEK_SET) != resumeoff)
+				err(1, "lseek");
+		} else
+			printf("Server does not resume dumps\n");
+	}
+	if (lz4 && (flags & NETDUMP_EXT_LZ4) == 0) {
+		lz4 = false;
+		printf("Server does not take compressed data\n");
+	}
 
 	/* Now we can transfer the file. */
-	ndmsgp = (struct netdump_msg_hdr *)buf;
-	for (off = r = 0; (r = read(fd, buf + sizeof(*ndmsgp),
-	    sizeof(buf) - sizeof(*ndmsgp))) > 0; off += r) {
+	buf = malloc(sizeof(*ndmsgp) + chunk);
+	if (buf == NULL)
+		err(1, "malloc");
+	zbuf = NULL;
+	if (lz4) {
+		zbuf = malloc(sizeof(*ndmsgp) + chunk);
+		if (zbuf == NULL)
+			err(1, "malloc");
+	}
+
+	/*
+	 * Keep several packets in flight if the server lets us know how much
+	 * it can take or which packets were lost, and whenever it delays its
+	 * ACKs or takes data on several streams. A packet whose ACK doesn't
+	 * come back in time is sent again.
+	 */
+	fl = NULL;
+	if ((flags & (NETDUMP_EXT_WINDOW | NETDUMP_EXT_SACK |
+	    NETDUMP_EXT_DELACK | NETDUMP_EXT_STREAMS | NETDUMP_EXT_FEC)) != 0) {
+		fl = calloc(1, sizeof(*fl));
+		if (fl == NULL)
+			err(1, "calloc");
+		fl->rbuf = malloc(sizeof(*ndmsgp) + chunk);
+		if (fl->rbuf == NULL)
+			err(1, "malloc");
+		fl->sd = sd;
+		fl->fd = fd;
+		fl->loss = loss;
+		fl->advwin = (flags & NETDUMP_EXT_WINDOW) != 0;
+		fl->sack = (flags & NETDUMP_EXT_SACK) != 0;
+		fl->cumack = (flags & NETDUMP_EXT_DELACK) != 0;
+		fl->nstreams = nstreams;
+		fl->fecgroup = fecgroup;
+		fl->stripe = UINT32_MAX;
+		if (nstreams > 1)
+			fl->stripe = MAX(ntohl(hack.nha_stripe), chunk);
+
+		/*
+		 * The first stream carries on from the herald; the others start
+		 * from scratch, each on its own server port.
+		 */
+		for (i = 0; i < nstreams; i++) {
+			st = &fl->streams[i];
+			st->sin = sin;
+			if (i > 0)
+				st->sin.sin_port = hack.nha_ports[i];
+			st->seqno = st->lastack = i == 0 ? seqno : 0;
+			st->window = fl->advwin ? ntohl(hack.nha_window) :
+			    DEFAULT_INFLIGHT * chunk;
+			if (fecgroup != 0) {
+				st->fec = calloc(1, sizeof(*st->fec) +
+				    sizeof(struct netdump_fec) + chunk);
+				if (st->fec == NULL)
+					err(1, "calloc");
+			}
+		}
+		printf("Using a %u-byte initial window\n",
+		    fl->streams[0].window);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = RETX_TIMEOUT_MS * 1000;
+		if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) != 0)
+			err(1, "setsockopt");
+	}
+	ndmsgp = (struct netdump_msg_hdr *)(void *)buf;
+	zmsg = (struct netdump_msg_hdr *)(void *)zbuf;
+	wirebytes = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	for (off = resumeoff, r = 0;; off += r) {
+		/* A packet must not cross a stripe boundary. */
+		len = chunk;
+		if (fl != NULL)
+			len = MIN(chunk,
+			    (size_t)(fl->stripe - off % fl->stripe));
+		if ((r = read(fd, buf + sizeof(*ndmsgp), len)) <= 0)
+			break;
 		ndmsgp->mh_type = htonl(NETDUMP_VMCORE);
-		ndmsgp->mh_seqno = htonl(++seqno);
 		ndmsgp->mh_offset = htobe64(off);
 		ndmsgp->mh_len = htonl((uint32_t)r);
-		sendndmsg(sd, &sin, ndmsgp);
-		waitack(sd, seqno);
+		sndmsg = ndmsgp;
+
+		/* Data that doesn't shrink is sent as is. */
+		if (lz4) {
+			clen = netdump_lz4_compress((uint8_t *)(ndmsgp + 1), r,
+			    (uint8_t *)(zmsg + 1), r);
+			if (clen != 0) {
+				zmsg->mh_type = htonl(NETDUMP_VMCORE_LZ4);
+				zmsg->mh_offset = ndmsgp->mh_offset;
+				zmsg->mh_len = htonl((uint32_t)clen);
+				sndmsg = zmsg;
+			}
+		}
+		wirebytes += ntohl(sndmsg->mh_len);
+		if (fl != NULL)
+			flow_send(fl, sndmsg, (uint32_t)r);
+		else {
+			sndmsg->mh_seqno = htonl(++seqno);
+			(void)clock_gettime(CLOCK_MONOTONIC, &sent);
+			sendndmsg(sd, &sin, sndmsg);
+			waitack(sd, seqno);
+			lat_record(&sent);
+		}
 	}
 
 	/* All done. */
-	memset(&ndmsg, 0, sizeof(ndmsg));
-	ndmsg.mh_type = htonl(NETDUMP_FINISHED);
-	sendndmsg(sd, &sin, &ndmsg);
-	waitack(sd, 0);
+	if (fl != NULL)
+		flow_finish(fl);
+	else {
+		memset(&ndmsg, 0, sizeof(ndmsg));
+		ndmsg.mh_type = htonl(NETDUMP_FINISHED);
+		sendndmsg(sd, &sin, &ndmsg);
+		waitack(sd, 0);
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = MAX(end.tv_sec - start.tv_sec +
+	    (end.tv_nsec - start.tv_nsec) / 1e9, 1e-9);
+	printf("%jd bytes in %.3f s (%.2f MB/s)\n", (intmax_t)(off - resumeoff),
+	    secs, (off - resumeoff) / secs / (1024 * 1024));
+	if (lz4)
+		printf("%ju bytes on the wire (%.2f:1), %.2f MB/s\n",
+		    (uintmax_t)wirebytes,
+		    (double)(off - resumeoff) / MAX(wirebytes, 1),
+		    wirebytes / secs / (1024 * 1024));
+	lat_report("ACK");
+	if (fl != NULL) {
+		printf("%.0f packets/s, %.0f ACKs/s\n", fl->nsent / secs,
+		    fl->nacks / secs);
+		printf("%ju packets sent, %ju ACKs received\n",
+		    (uintmax_t)fl->nsent, (uintmax_t)fl->nacks);
+		printf("%ju retransmissions (%ju prompted by SACKs), "
+		    "%ju packets dropped\n", (uintmax_t)fl->nretx,
+		    (uintmax_t)fl->nsackretx, (uintmax_t)fl->ndropped);
+		if (fl->fecgroup != 0)
+			printf("%ju parity packets sent\n",
+			    (uintmax_t)fl->nparity);
+		for (i = 0; i < fl->nstreams; i++)
+			free(fl->streams[i].fec);
+		free(fl->rbuf);
+	}
 
 	(void)close(fd);
 	(void)close(sd);
+	free(buf);
+	free(zbuf);
+	free(fl);
 	free(addr);
 	free(path);
 	free(msg.msg_iov);
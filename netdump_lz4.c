@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A small implementation of the LZ4 block format, used to compress VMCORE
+ * payloads on the wire. Payloads are at most NETDUMP_DATASIZE_MAX bytes, so a
+ * block is compressed in one pass with a hash table of 16-bit positions, and
+ * every match offset fits the format's 16-bit field.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "netdumpd.h"
+
+#define	LZ4_MINMATCH	4
+#define	LZ4_LASTLITERALS 5	/* The block ends with this many literals, */
+#define	LZ4_MFLIMIT	12	/* and the last match starts before these. */
+#define	LZ4_HASHLOG	12
+#define	LZ4_MAXINPUT	65536	/* Positions must fit the hash table. */
+
+static inline uint32_t
+lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint32_t
+lz4_hash(uint32_t v)
+{
+
+	return ((v * 2654435761U) >> (32 - LZ4_HASHLOG));
+}
+
+/* Encode a length that didn't fit in its token nibble. */
+static uint8_t *
+lz4_putlen(uint8_t *op, size_t len)
+{
+
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return (op);
+}
+
+/*
+ * Compress a payload into an LZ4 block. Returns the length of the block, or 0
+ * if it wouldn't be shorter than dstlen bytes, in which case the payload is
+ * best sent as is.
+ */
+size_t
+netdump_lz4_compress(const uint8_t *src, size_t srclen, uint8_t *dst,
+    size_t dstlen)
+{
+	uint16_t table[1 << LZ4_HASHLOG];
+	const uint8_t *anchor, *end, *ip, *mflimit, *ref;
+	uint8_t *op, *oend, *token;
+	size_t litlen, mlen;
+	uint32_t h, seq;
+
+	if (srclen > LZ4_MAXINPUT)
+		return (0);
+	memset(table, 0, sizeof(table));
+	anchor = ip = src;
+	end = src + srclen;
+	mflimit = srclen >= LZ4_MFLIMIT ? end - LZ4_MFLIMIT : src;
+	op = dst;
+	oend = dst + dstlen;
+
+	while (ip < mflimit) {
+		seq = lz4_read32(ip);
+		h = lz4_hash(seq);
+		ref = src + table[h];
+		table[h] = (uint16_t)(ip - src);
+		if (ref >= ip || lz4_read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match backwards over pending literals. */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		for (mlen = LZ4_MINMATCH;
+		    ip + mlen < end - LZ4_LASTLITERALS && ip[mlen] == ref[mlen];
+		    mlen++)
+			;
+
+		/* Token, literals, offset and match length must all fit. */
+		litlen = ip - anchor;
+		if (op + 1 + litlen / 255 + 1 + litlen + 2 +
+		    (mlen - LZ4_MINMATCH) / 255 + 1 > oend)
+			return (0);
+		token = op++;
+		if (litlen >= 15) {
+			*token = 15 << 4;
+			op = lz4_putlen(op, litlen - 15);
+		} else
+			*token = (uint8_t)(litlen << 4);
+		memcpy(op, anchor, litlen);
+		op += litlen;
+		*op++ = (uint8_t)(ip - ref);
+		*op++ = (uint8_t)((ip - ref) >> 8);
+		if (mlen - LZ4_MINMATCH >= 15) {
+			*token |= 15;
+			op = lz4_putlen(op, mlen - LZ4_MINMATCH - 15);
+		} else
+			*token |= (uint8_t)(mlen - LZ4_MINMATCH);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	/* The last sequence only holds literals. */
+	litlen = end - anchor;
+	if (op + 1 + litlen / 255 + 1 + litlen >= oend)
+		return (0);
+	token = op++;
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		op = lz4_putlen(op, litlen - 15);
+	} else
+		*token = (uint8_t)(litlen << 4);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	return (op - dst);
+}
+
+/*
+ * Decompress an LZ4 block into at most dstlen bytes. Returns the length of the
+ * data, or -1 if the block is malformed or the data doesn't fit.
+ */
+ssize_t
+netdump_lz4_decompress(const uint8_t *src, size_t srclen, uint8_t *dst,
+    size_t dstlen)
+{
+	const uint8_t *end, *ip;
+	size_t len, off, op;
+	uint8_t b, token;
+
+	ip = src;
+	end = src + srclen;
+	op = 0;
+	for (;;) {
+		if (ip == end)
+			return (-1);
+		token = *ip++;
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip == end)
+					return (-1);
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > (size_t)(end - ip) || len > dstlen - op)
+			return (-1);
+		memcpy(dst + op, ip, len);
+		ip += len;
+		op += len;
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return (-1);
+		off = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > op)
+			return (-1);
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip == end)
+					return (-1);
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ4_MINMATCH;
+		if (len > dstlen - op)
+			return (-1);
+		if (off >= len)
+			memcpy(dst + op, dst + op - off, len);
+		else
+			/* The match overlaps the data it produces. */
+			for (; len > 0; len--, op++)
+				dst[op] = dst[op - off];
+		op += len;
+	}
+	return ((ssize_t)op);
+}
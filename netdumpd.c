@@ -32,30 +32,38 @@ __FBSDID("$FreeBSD$");
 #include <sys/endian.h>
 #include <sys/errno.h>
 #include <sys/event.h>
+#include <sys/ioctl.h>
 #include <sys/kerneldump.h>
 #include <sys/nv.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/netdump/netdump.h>
 
+#include <aio.h>
 #include <assert.h>
 #include <capsicum_helpers.h>
 #include <err.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
 #include <unistd.h>
 
@@ -64,12 +72,44 @@ __FBSDID("$FreeBSD$");
 
 #include <libutil.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "netdumpd.h"
 #include "kerneldump_compat.h"
 
 #define	MAX_DUMPS	1024	/* Maximum saved dumps per remote host. */
-#define	CLIENT_TIMEOUT	600	/* Netdump timeout period, in seconds. */
-#define	CLIENT_TPASS	10	/* Scan for timed-out clients every 10s. */
+#define	CLIENT_TIMEOUT	600	/* Longest client timeout, in seconds. */
+#define	CLIENT_TIMEOUT_IDLE 60	/* Timeout until dump data arrives. */
+#define	CLIENT_TIMEOUT_MIN 30	/* Shortest timeout once data flows. */
+#define	CLIENT_GAP_MULT	8	/* Timeout, in longest message gaps. */
+#define	CLIENT_TPASS	10	/* Report statistics every 10s. */
+#define	WHEEL_SLOTS	1024	/* Timer wheel slots, one second each. */
+#define	CLIENT_BATCH	32	/* Max. packets received per read event. */
+#define	ACK_PENDING	256	/* Max. ACKs queued for a writable socket. */
+#define	DELACK_SEQNOS	1024	/* Seqnos tracked past the cumulative ACK. */
+#define	DELACK_PKTS_MAX	64	/* Max. packets per delayed ACK. */
+#define	DELACK_USEC_MAX	100000	/* Max. ACK delay. */
+#define	MAX_WORKERS	64	/* Maximum number of worker threads. */
+#define	MAX_WRITERS	64	/* Maximum number of writer threads. */
+#define	CLIENT_HASHBITS	10
+#define	CLIENT_HASHSIZE	(1 << CLIENT_HASHBITS) /* Client table buckets. */
+#define	NAMECACHE_SIZE	256	/* Client hostnames cached. */
+#define	NAMECACHE_TTL	3600	/* Lifetime of a resolved hostname. */
+#define	NAMECACHE_NEGTTL 60	/* Lifetime of a failed lookup. */
+#define	NAMECACHE_PENDTTL 30	/* Lifetime of an unanswered lookup. */
+#define	RESOLVE_TIMEOUT	2	/* Max. wait for a client's name. */
+#define	RESOLVER_THREADS 4	/* Lookups in flight. */
+#define	RESOLVER_EVENT	1	/* Dispatcher EVFILT_USER ident. */
+#define	LATENCY_BUCKETS	32	/* Herald ACK latency histogram. */
+
+#if __FreeBSD_version >= 1100000
+#define	HAVE_RECVMMSG
+#define	HAVE_SENDMMSG
+#endif
 
 #define	LOGERR(m, ...)							\
 	(*g_phook)(LOG_ERR | LOG_DAEMON, (m), ## __VA_ARGS__)
@@ -81,41 +121,424 @@ __FBSDID("$FreeBSD$");
 	(*g_phook)(LOG_WARNING | LOG_DAEMON, (m), ## __VA_ARGS__)
 
 #define	client_ntoa(cl)							\
-	inet_ntoa((cl)->ip)
+	((const char *)(cl)->ipstr)
 #define	client_pinfo(cl, f, ...)					\
-	fprintf((cl)->infofile, (f), ## __VA_ARGS__)
+	((cl)->infofile != NULL ?					\
+	    fprintf((cl)->infofile, (f), ## __VA_ARGS__) : 0)
 
+/*
+ * A received packet. The payload is scattered directly into the client's
+ * vmcore buffer when possible, so we only keep a pointer to it.
+ */
 struct netdump_pkt {
 	struct netdump_msg_hdr hdr;
-	uint8_t		data[NETDUMP_DATASIZE];
-} __packed;
+	uint8_t		*data;
+};
+
+#define	VMCORE_BUFSZ	(128 * 1024)	/* Default vmcore buffer size. */
+#define	VMCORE_BUFSZ_MAX (16 * 1024 * 1024)
+#define	VMCORE_NBUF	8	/* Default buffers being written per client. */
+#define	VMCORE_NBUF_MAX	1024
+#define	VMCORE_POOL_MAX	(32 * 1024 * 1024) /* Free buffer bytes kept. */
+#define	ZERO_BLKSZ	4096	/* Granularity of zero-block skipping. */
+#define	REORDER_SLOTS	64	/* Out-of-order packets held per client. */
+#define	FEC_GROUPS	8	/* Parity groups tracked per client. */
+#define	EXTENTS_MAX	65536	/* Received extents tracked per client. */
+#define	HOLES_MAX	16	/* Holes listed in the info file. */
+
+/*
+ * A buffer of contiguous vmcore data. Clients fill buffers from their event
+ * loop. When writer threads are configured, full buffers are handed to the
+ * client's writer through a single-producer/single-consumer ring, and are
+ * returned to a shared pool once written. With asynchronous I/O, full buffers
+ * are instead submitted with aio_write(2) from the event loop, which is
+ * notified of completions through its kqueue.
+ */
+struct vmcore_buf {
+	STAILQ_ENTRY(vmcore_buf) link;
+	off_t		off;		/* File offset of the data. */
+	ssize_t		len;		/* Bytes of data. */
+	struct aiocb	aiocb;		/* Asynchronous write control block. */
+	uint8_t		data[];		/* g_vbsize bytes. */
+};
+
+/*
+ * Out-of-order vmcore packets, held until the data preceding them arrives so
+ * that buffers stay contiguous. Only packets within REORDER_SLOTS payloads of
+ * the end of the buffered data are held, in any free slot; slots are looked up
+ * by exact offset, so payloads need not be aligned to the payload size.
+ */
+struct vmcore_reorder {
+	int		nheld;
+	struct reorder_slot {
+		off_t		off;
+		uint32_t	len;		/* 0 if the slot is free. */
+		uint8_t		*data;		/* The client's payload size. */
+	} slots[REORDER_SLOTS];
+	uint8_t		data[];
+};
+
+/*
+ * The set of byte ranges of the dump received so far, as a sorted array of
+ * disjoint, non-adjacent extents. Data normally arrives in order and extends
+ * the last extent.
+ */
+struct extent {
+	off_t		start;
+	off_t		end;
+};
+
+struct extent_set {
+	struct extent	*ext;
+	int		n;
+	int		cap;
+	bool		overflow;	/* Too fragmented; tracking stopped. */
+};
+
+/*
+ * Forward error correction state. Each group being received accumulates the
+ * XOR of its messages' offsets, lengths and payloads, so that once the parity
+ * message and all but one of the messages covered have arrived, the missing one
+ * is what is left. Groups are tracked in the slot indexed by their number, and
+ * a newer group evicts an older one.
+ */
+struct fec_state {
+	int		npending;	/* Groups with a message to rebuild. */
+	struct fec_group {
+		bool		used;
+		uint32_t	first;	/* First seqno of the group. */
+		uint64_t	rcvd;	/* Seqnos received, as seqno % group. */
+		uint32_t	nrcvd;
+		bool		parity;	/* The parity message was received. */
+		uint32_t	pfirst;	/* First seqno it covers. */
+		uint32_t	count;	/* Messages it covers. */
+		bool		pending; /* A rebuilt message is to be handled. */
+		bool		done;	/* Nothing is left to rebuild. */
+		uint64_t	off;
+		uint32_t	len;
+		uint8_t		*data;	/* The client's payload size. */
+	} groups[FEC_GROUPS];
+	uint8_t		data[];
+};
 
-#define	VMCORE_BUFSZ	(128 * 1024)
+struct netdump_worker;
+struct netdump_writer;
 
 struct netdump_client {
-	LIST_ENTRY(netdump_client) iter;
+	LIST_ENTRY(netdump_client) iter;	/* Global client table. */
+	LIST_ENTRY(netdump_client) witer;	/* Worker's client list. */
+	LIST_ENTRY(netdump_client) tlink;	/* Worker's timer wheel. */
+	STAILQ_ENTRY(netdump_client) reqlink;	/* Worker request queue. */
+	struct netdump_worker *worker;	/* Owning event loop. */
+	int		reqs;		/* Pending worker requests. */
+#define	CLIENT_REQ_ADOPT	0x01	/* Start servicing the client. */
+#define	CLIENT_REQ_EXPIRE	0x02	/* Time out the client. */
+#define	CLIENT_REQ_RESUME	0x04	/* The writer freed ring slots. */
+#define	CLIENT_REQ_SYNCED	0x08	/* The core file was synced. */
+#define	CLIENT_REQ_WERROR	0x10	/* The writer failed. */
+#define	CLIENT_REQ_DRAIN	0x20	/* Write out a stream's data. */
+#define	CLIENT_REQ_STREAMS	0x40	/* Every stream was drained. */
+#define	CLIENT_REQ_SFAIL	0x80	/* A stream failed. */
+#define	CLIENT_REQ_RENAME	0x100	/* The client's name was resolved. */
+	bool		expiring;	/* Expiration was requested. */
+	bool		dead;		/* Freed, awaiting reclamation. */
+	atomic_int	refs;		/* Owner and writer references. */
 	char		*path;
 	char		infofilename[MAXPATHLEN];
 	char		corefilename[MAXPATHLEN];
 	char		hostname[NI_MAXHOST];
+	bool		provisional;	/* Named by address until resolved. */
+	char		newname[NI_MAXHOST]; /* For CLIENT_REQ_RENAME. */
 	time_t		last_msg;
+	time_t		max_gap;	/* Longest time between messages. */
+	time_t		deadline;	/* Timer wheel expiry. */
+	bool		timer_armed;
 	struct in_addr	ip;
+	char		ipstr[INET_ADDRSTRLEN];
 	FILE		*infofile;
 	int		corefd;
 	int		keyfilefd;
 	int		sock;
 	int		index;
-	bool		any_data_rcvd;
-	ssize_t		vmcorebufoff;
-	off_t		vmcoreoff;
-	uint8_t		vmcorebuf[VMCORE_BUFSZ];
+	atomic_bool	any_data_rcvd;
+	bool		ext;		/* The herald requested extensions. */
+	uint32_t	ext_flags;	/* Accepted NETDUMP_EXT_* features. */
+	uint32_t	datasize;	/* Largest VMCORE payload. */
+	uint64_t	token;		/* Identity of a resumable dump, or 0. */
+	bool		resumed;	/* Carrying on with a saved dump. */
+	off_t		resume_off;	/* Data received from offset 0. */
+	int		rcvbufsz;	/* Socket receive buffer size. */
+	uint64_t	rcv_events;	/* Read events handled. */
+	uint64_t	rcv_syscalls;	/* Receive syscalls issued. */
+	uint64_t	rcv_pkts;	/* Packets received. */
+	uint64_t	ack_pkts;	/* ACKs sent. */
+	uint64_t	ack_syscalls;	/* Send syscalls issued for ACKs. */
+	uint64_t	ack_queued;	/* ACKs queued on a full socket buffer. */
+	uint64_t	ack_retried;	/* Queued ACKs sent later. */
+	uint64_t	ack_dropped;	/* ACKs dropped from a full queue. */
+	bool		ack_batching;	/* Queue ACKs until the batch is done. */
+	int		nacks;
+	uint32_t	ackq[CLIENT_BATCH];
+	bool		ack_wait;	/* Waiting for the socket to drain. */
+	uint32_t	ack_seqno;	/* Last seqno ACKed. */
+	uint32_t	ack_window;	/* Last window advertised. */
+	uint64_t	ack_updates;	/* Window updates sent. */
+	int		nackpend;
+	uint32_t	ackpend[ACK_PENDING];
+
+	/* Delayed cumulative ACKs. */
+	uint32_t	delack_pkts;	/* ACK every this many packets, */
+	uint32_t	delack_usec;	/* or this long after the first one. */
+	uint32_t	ack_cum;	/* Every seqno up to this one was received. */
+	uint64_t	ack_seen[DELACK_SEQNOS / 64]; /* Seqnos past ack_cum. */
+	uint32_t	ack_unsent;	/* Packets not yet acknowledged. */
+	bool		ack_timer;	/* The delayed ACK timer is armed. */
+	uint64_t	ack_expired;	/* ACKs sent by the timer. */
+
+	/* Forward error correction. */
+	uint32_t	fec_group;	/* Seqnos per parity group, or 0. */
+	struct fec_state *fec;		/* Allocated on first use. */
+	uint64_t	fec_parity;	/* Parity messages received. */
+	uint64_t	fec_recovered;	/* Messages rebuilt from parity. */
+
+	/* Compressed payloads. */
+	uint64_t	lz4_pkts;
+	uint64_t	lz4_bytes;	/* Received. */
+	uint64_t	lz4_rawbytes;	/* Once decompressed. */
+
+	uint64_t	vmcore_rcvd;	/* vmcore bytes received. */
+	uint64_t	vmcore_copied;	/* vmcore bytes copied after receipt. */
+	uint64_t	vmcore_held;	/* vmcore packets received early. */
+	uint64_t	vmcore_dup;	/* Duplicate vmcore bytes dropped. */
+	struct extent_set rcvd;		/* vmcore ranges received. */
+	uint64_t	dumplen;	/* From the KDH, or 0 if unknown. */
+	off_t		vmcore_next;	/* End of the data appended last. */
+	struct vmcore_reorder *reorder;	/* Allocated on first use. */
+	bool		preallocated;	/* Space for the dump was reserved. */
+	bool		truncated;	/* The dump length is known. */
+	off_t		extent_end;	/* End of the received vmcore data. */
+	uint64_t	zero_skipped;	/* Zero bytes not written. */
+	bool		finishing;	/* Waiting for the core file sync. */
+	uint32_t	finish_seqno;
+	struct vmcore_buf *vb;		/* Buffer being filled. */
+	STAILQ_HEAD(, vmcore_buf) vbpend; /* Full, not yet queued. */
+	bool		rdisabled;	/* Reads stopped for the writer. */
+
+	/* Asynchronous write state. */
+	bool		aio;		/* Write with aio_write(2). */
+	int		aio_inflight;
+	STAILQ_HEAD(, vmcore_buf) aioq;	/* Writes in flight. */
+
+	/*
+	 * Writer state. The ring is filled by the client's event loop and
+	 * drained by its writer. Control requests are posted only once all
+	 * preceding buffers have been queued.
+	 */
+	struct netdump_writer *writer;
+	STAILQ_ENTRY(netdump_client) wlink; /* Writer run queue. */
+	bool		wqueued;	/* Protected by the writer lock. */
+	struct vmcore_buf **ring;	/* g_vbcount slots. */
+	off_t		*ring_off;	/* Offsets of the slots' buffers. */
+	atomic_uint_fast64_t ring_head;	/* Next slot filled by the owner. */
+	atomic_uint_fast64_t ring_tail;	/* Next slot drained by the writer. */
+	atomic_bool	wstalled;	/* The owner is waiting for a slot. */
+	int		wctl_pending;	/* Control requests not yet posted. */
+	atomic_int	wctl;		/* Control requests for the writer. */
+#define	WCTL_TRUNCATE	0x01
+#define	WCTL_SYNC	0x02
+	off_t		trunclen;
+	atomic_bool	werror;
+	int		werrno;
+	off_t		werroff;
+
+	/*
+	 * Striped transfers. Each additional stream is serviced by a client of
+	 * its own, possibly on another event loop, which holds a reference on
+	 * its parent and writes to the parent's core file. Streams have no
+	 * info file, and only handle VMCORE messages.
+	 */
+	struct netdump_client *parent;	/* NULL for the herald's stream. */
+	int		nstreams;
+	struct netdump_client *streams[NETDUMP_STREAMS_MAX]; /* Referenced. */
+	uint16_t	stream_ports[NETDUMP_STREAMS_MAX];
+	atomic_int	streams_busy;	/* Streams being drained. */
+	bool		streams_merged;	/* Stream extents were merged. */
+	bool		drained;	/* Stream data was written out. */
+	atomic_llong	stream_msg;	/* Last message on any stream. */
+};
+
+/*
+ * A writer thread. Writers service clients queued on their run queue by
+ * writing out the buffers in each client's ring.
+ */
+struct netdump_writer {
+	pthread_t	thread;
+	int		id;
+	pthread_mutex_t	lock;		/* Protects the run queue. */
+	pthread_cond_t	cv;
+	STAILQ_HEAD(, netdump_client) runq;
+	bool		exiting;
+
+	/* Statistics. */
+	uint64_t	nwrites;
+	uint64_t	wbytes;
+};
+
+/*
+ * An event loop servicing a set of clients. The main thread's loop, the
+ * dispatcher, handles heralds and signals. By default it also services all
+ * clients; when worker threads are configured, each new client is instead
+ * handed to the least loaded worker, which owns it for the rest of its
+ * lifetime. Other threads communicate with a client's owner by posting
+ * requests to its queue and triggering its EVFILT_USER event.
+ */
+struct netdump_worker {
+	pthread_t	thread;
+	int		id;
+	int		kq;
+	int		nclients;	/* Protected by g_clients_lock. */
+	bool		failed;		/* Protected by g_clients_lock. */
+	time_t		now;
+	time_t		last_timeout_check;
+	LIST_HEAD(, netdump_client) clients;
+	LIST_HEAD(, netdump_client) dead;
+
+	/*
+	 * Client timeouts. A client sits in the slot of its deadline, and
+	 * wheel_tick is the next second to expire. Deadlines are checked
+	 * against the client's activity when they expire, so messages never
+	 * touch the wheel.
+	 */
+	LIST_HEAD(, netdump_client) wheel[WHEEL_SLOTS];
+	time_t		wheel_tick;
+	int		ntimers;
+
+	pthread_mutex_t	lock;		/* Protects the request queue. */
+	STAILQ_HEAD(, netdump_client) reqq;
+
+	/* Statistics. */
+	uint64_t	ndumps;
+	uint64_t	rcv_pkts;
+	uint64_t	rcv_bytes;
+	uint64_t	rcv_bytes_last;	/* Snapshot at the last timeout pass. */
+
+	/*
+	 * Receive batch, shared by the worker's clients. Payloads that do not
+	 * fit in the client's vmcore buffer land in the overflow buffers
+	 * instead.
+	 */
+	struct netdump_pkt pkts[CLIENT_BATCH];
+	ssize_t		pktlens[CLIENT_BATCH];
+	uint8_t		pktovfl[CLIENT_BATCH][NETDUMP_DATASIZE_MAX];
+	uint8_t		lz4buf[NETDUMP_DATASIZE_MAX]; /* Decompressed payload. */
+	struct iovec	pktiovs[CLIENT_BATCH][2];
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr	pktmsgs[CLIENT_BATCH];
+#define	PKTMSG(w, i)	(&(w)->pktmsgs[(i)].msg_hdr)
+#else
+	struct msghdr	pktmsgs[CLIENT_BATCH];
+#define	PKTMSG(w, i)	(&(w)->pktmsgs[(i)])
+#endif
+};
+
+/*
+ * Reverse lookups of client addresses. Each resolver thread has its own
+ * system.dns channel, so that a slow lookup only holds up one of them. Names
+ * are cached by the dispatcher, which is the only thread to look at the cache;
+ * an entry without a name marks a lookup in progress, and expires like any
+ * other in case the lookup never completes.
+ */
+struct name_req {
+	STAILQ_ENTRY(name_req) link;
+	struct sockaddr_in saddr;
+	bool		resolved;	/* false if the address has no name. */
+	char		hostname[NI_MAXHOST];
+};
+
+struct name_entry {
+	TAILQ_ENTRY(name_entry) link;	/* LRU order. */
+	struct in_addr	ip;
+	time_t		expires;
+	bool		pending;	/* No name yet. */
+	char		hostname[NI_MAXHOST];
+};
+
+struct name_resolver {
+	pthread_t	threads[RESOLVER_THREADS];
+	cap_channel_t	*chans[RESOLVER_THREADS];
+	int		nthreads;
+	pthread_mutex_t	lock;		/* Protects the queues. */
+	pthread_cond_t	cv;
+	STAILQ_HEAD(, name_req) reqq;
+	STAILQ_HEAD(, name_req) doneq;
+	bool		exiting;
+};
+
+/*
+ * A herald resuming a dump whose state was saved under the client's name. It is
+ * ACKed once the name is known or RESOLVE_TIMEOUT seconds have passed,
+ * whichever comes first.
+ */
+struct herald_pending {
+	TAILQ_ENTRY(herald_pending) link;
+	struct netdump_herald nh;
+	time_t		deadline;
 };
 
-/* Clients list. */
-static LIST_HEAD(, netdump_client) g_clients = LIST_HEAD_INITIALIZER(g_clients);
+/*
+ * Clients table, hashed by address so that heralds find a host's dumps without
+ * scanning every client. A dump's streams hash with it.
+ */
+static LIST_HEAD(, netdump_client) g_clients[CLIENT_HASHSIZE];
+static pthread_mutex_t g_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+#define	CLIENT_HASH(ip)							\
+	(&g_clients[(ntohl((ip).s_addr) * 2654435761U) >>		\
+	    (32 - CLIENT_HASHBITS)])
+
+/* Event loops. */
+static struct netdump_worker g_dispatcher;
+static struct netdump_worker *g_workers;
+static int g_nworkers;
+static atomic_bool g_shutdown;
+static int g_maxstreams = 1;	/* Streams per striped dump. */
+static int g_herald_pool = NETDUMP_HERALD_POOL; /* Pooled herald sockets. */
+
+/* Writer threads and the pool of vmcore buffers. */
+static struct netdump_writer *g_writers;
+static int g_nwriters;
+static int g_nextwriter;
+static STAILQ_HEAD(, vmcore_buf) g_vbpool = STAILQ_HEAD_INITIALIZER(g_vbpool);
+static int g_vbpool_cnt;
+static int g_vbpool_max;
+static size_t g_vbsize = VMCORE_BUFSZ;	/* Size of each vmcore buffer. */
+static int g_vbcount = VMCORE_NBUF;	/* Buffers being written per client. */
+static pthread_mutex_t g_vbpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool g_aio;	/* Use asynchronous I/O for new clients. */
 
 /* Capabilities. */
 static cap_channel_t *g_capdns, *g_caphandler, *g_capherald;
+static pthread_mutex_t g_caphandler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Client hostnames, and heralds waiting for one. */
+static struct name_resolver g_resolver = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+	.reqq = STAILQ_HEAD_INITIALIZER(g_resolver.reqq),
+	.doneq = STAILQ_HEAD_INITIALIZER(g_resolver.doneq),
+};
+static TAILQ_HEAD(name_entry_list, name_entry) g_names =
+    TAILQ_HEAD_INITIALIZER(g_names);
+static int g_nnames;
+static TAILQ_HEAD(, herald_pending) g_heralds =
+    TAILQ_HEAD_INITIALIZER(g_heralds);
+
+/*
+ * Time from the arrival of a herald to its ACK, in microseconds. Bucket i
+ * counts latencies below 2^i us and at least 2^(i-1) us.
+ */
+static uint64_t g_herald_lat[LATENCY_BUCKETS];
+static uint64_t g_herald_nlat;
+static uint64_t g_herald_nlat_last;	/* Snapshot at the last report. */
 
 /* Program arguments handlers. */
 static char g_dumpdir[MAXPATHLEN];
@@ -126,9 +549,6 @@ static struct in_addr g_bindip;
 
 /* Miscellaneous handlers. */
 static struct pidfh *g_pfh;
-static time_t g_now;
-static time_t g_last_timeout_check;
-static int g_kq;
 static int g_sock = -1;
 static bool g_debug = false;
 
@@ -136,32 +556,69 @@ static bool g_debug = false;
 static void (*g_phook)(int, const char *, ...);
 
 static struct netdump_client *alloc_client(int sd, struct sockaddr_in *saddr,
-		    char *path);
+		    const char *hostname, char *path,
+		    const struct netdump_herald_ext *ext);
+static void	client_adopt(struct netdump_client *client);
+static void	client_attach(struct netdump_client *client);
 static void	client_event(struct netdump_client *client);
+static int	client_finish(struct netdump_client *client);
+static void	client_rele(struct netdump_client *client);
+static void	client_request(struct netdump_client *client, int req);
 static int	eventloop(void);
 static void	exec_handler(struct netdump_client *client, const char *reason);
 static void	free_client(struct netdump_client *client);
-static void	handle_finish(struct netdump_client *client,
+static int	handle_finish(struct netdump_client *client,
 		    struct netdump_pkt *pkt);
-static void	handle_kdh(struct netdump_client *client,
+static int	handle_kdh(struct netdump_client *client,
 		    struct netdump_pkt *pkt);
 static void	handle_timeout(struct netdump_client *client);
-static void	handle_vmcore(struct netdump_client *client,
+static void	herald_expire(time_t now);
+static void	herald_flush(void);
+static void	herald_latency_report(void);
+static void	resolver_done(void);
+static int	resume_open(struct netdump_client *client, const char *dir);
+static void	resume_remove(struct netdump_client *client);
+static int	resume_save(struct netdump_client *client);
+static int	handle_vmcore(struct netdump_client *client,
 		    struct netdump_pkt *pkt);
 static void	phook_printf(int priority, const char *message, ...)
 		    __printflike(2, 3);
 static void	send_ack(struct netdump_client *client, uint32_t seqno);
+static void	send_acks(struct netdump_client *client);
+static void	client_window_update(struct netdump_client *client);
+static int	client_sacks(const struct netdump_client *client,
+		    struct netdump_sack *sacks);
+static void	send_ack_direct(int sd, uint32_t seqno);
+static void	send_herald_ack(struct netdump_client *client,
+		    uint32_t seqno);
 static void	server_event(void);
-static void	timeout_clients(void);
+static void	timeout_clients(struct netdump_worker *w);
+static void	timer_arm(struct netdump_client *client, time_t deadline);
+static void	timer_cancel(struct netdump_client *client);
+static time_t	client_timeout(const struct netdump_client *client);
 static void	usage(void);
+static ssize_t	vmcore_aio_wait(struct vmcore_buf *vb);
+static void	vmcore_commit(struct netdump_client *client);
+static void	vmcore_error(struct netdump_client *client, int error,
+		    off_t off);
+static int	vmcore_finish(struct netdump_client *client);
+static int	vmcore_flush(struct netdump_client *client);
+static int	vmcore_reorder_write(struct netdump_client *client,
+		    off_t below);
+static void	worker_drain(struct netdump_worker *w);
+static int	worker_loop(struct netdump_worker *w);
+static void	worker_reap(struct netdump_worker *w);
+static void	worker_requests(struct netdump_worker *w);
+static void	worker_wakeup(struct netdump_worker *w);
 
 static void
 usage(void)
 {
 
 	fprintf(stderr,
-"usage: %s [-D] [-a <bind_addr>] [-d <dumpdir>] [-i <script>] [-P <pidfile>]\n"
-"\t\t[-p <default path>]\n",
+"usage: %s [-AD] [-a <bind_addr>] [-b <buffers>] [-d <dumpdir>] [-i <script>]\n"
+"\t\t[-m <streams>] [-P <pidfile>] [-p <default path>] [-S <sockets>]\n"
+"\t\t[-s <bufsize>] [-t <threads>] [-w <writers>]\n",
 	    getprogname());
 }
 
@@ -351,48 +808,247 @@ open_client_files(struct netdump_client *client, const char *dir)
 }
 
 /*
- * Allocate a bookkeeping structure for a new client. The client may, in its
- * herald message, specify a path relative to the dumpdir in which to store the
- * dump.
+ * Link a dump file under the client's new name: the basename
+ * "<prefix>.<oldname>.<index><suffix>" becomes "<prefix>.<newname>.<index>
+ * <suffix>". Linking, unlike renameat(), never replaces an existing file.
  */
-static struct netdump_client *
-alloc_client(int sd, struct sockaddr_in *saddr, char *path)
+static int
+link_client_file(const char *oldpath, char *newpath, size_t size,
+    const char *oldname, const char *newname, int index)
 {
-	struct kevent event;
-	struct netdump_client *client;
-	char *firstdot, *origpath;
-	int error, bufsz;
+	const char *base, *dot, *suffix;
+	size_t len, namelen;
+
+	base = strrchr(oldpath, '/');
+	base = base == NULL ? oldpath : base + 1;
+	dot = strchr(base, '.');
+	namelen = strlen(oldname);
+	if (dot == NULL || strncmp(dot + 1, oldname, namelen) != 0 ||
+	    dot[namelen + 1] != '.') {
+		LOGERR("Unexpected dump file name '%s'\n", oldpath);
+		errno = EINVAL;
+		return (-1);
+	}
+	suffix = dot + namelen + 2;
+	suffix += strspn(suffix, "0123456789");
+	len = snprintf(newpath, size, "%.*s%s.%d%s", (int)(dot + 1 - oldpath),
+	    oldpath, newname, index, suffix);
+	if (len >= size) {
+		LOGERR("Truncated dump file path: '%s'\n", newpath);
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (linkat(g_dumpdir_fd, oldpath, g_dumpdir_fd, newpath, 0));
+}
 
-	client = calloc(1, sizeof(*client));
-	if (client == NULL) {
-		LOGERR_PERROR("calloc()");
-		goto error_out;
+/*
+ * Move a dump that was started under its client's address to the name the
+ * resolver found, picking the first index free under that name. The dump
+ * keeps its address-based files if they can't be moved.
+ */
+static void
+client_rename(struct netdump_client *client)
+{
+	char oldname[NI_MAXHOST], oldkey[MAXPATHLEN], newkey[MAXPATHLEN];
+	char newinfo[MAXPATHLEN], newcore[MAXPATHLEN];
+	int error, i, index, start;
+
+	memcpy(oldname, client->hostname, sizeof(oldname));
+	(void)strlcpy(client->hostname, client->newname,
+	    sizeof(client->hostname));
+	start = read_index(client, client->path);
+	if (start < 0)
+		start = 0;
+	error = EEXIST;
+	for (i = 0; i < MAX_DUMPS && error == EEXIST; i++) {
+		index = (start + i) % MAX_DUMPS;
+		if (link_client_file(client->infofilename, newinfo,
+		    sizeof(newinfo), oldname, client->hostname, index) != 0) {
+			error = errno;
+			continue;
+		}
+		if (link_client_file(client->corefilename, newcore,
+		    sizeof(newcore), oldname, client->hostname, index) != 0) {
+			error = errno;
+			(void)unlinkat(g_dumpdir_fd, newinfo, 0);
+			continue;
+		}
+		error = 0;
+	}
+	if (error != 0) {
+		LOGWARN("Can't rename dump from %s [%s] to %s: %s\n", oldname,
+		    client_ntoa(client), client->hostname, strerror(error));
+		memcpy(client->hostname, oldname, sizeof(client->hostname));
+		return;
 	}
 
-	client->corefd = client->keyfilefd = -1;
-	client->index = -1;
-	client->sock = sd;
-	client->last_msg = g_now;
-	client->ip = saddr->sin_addr;
+	/* An existing key file is stale, as when it is first opened. */
+	if (client->keyfilefd != -1) {
+		(void)snprintf(oldkey, sizeof(oldkey), "%s/key.%s.%d",
+		    client->path, oldname, client->index);
+		(void)snprintf(newkey, sizeof(newkey), "%s/key.%s.%d",
+		    client->path, client->hostname, index);
+		if (renameat(g_dumpdir_fd, oldkey, g_dumpdir_fd, newkey) != 0)
+			LOGERR("renameat(%s): %s\n", oldkey, strerror(errno));
+	}
+	(void)unlinkat(g_dumpdir_fd, client->infofilename, 0);
+	(void)unlinkat(g_dumpdir_fd, client->corefilename, 0);
+	(void)strlcpy(client->infofilename, newinfo,
+	    sizeof(client->infofilename));
+	(void)strlcpy(client->corefilename, newcore,
+	    sizeof(client->corefilename));
+	client->index = index;
+	(void)write_index(client);
+	LOGINFO("Dump from %s renamed to %s\n", oldname,
+	    client->corefilename);
+}
 
-	error = cap_getnameinfo(g_capdns, (struct sockaddr *)saddr,
-	    saddr->sin_len, client->hostname, sizeof(client->hostname),
-	    NULL, 0, NI_NAMEREQD);
-	if (error != 0) {
-		/* Can't resolve, try with a numeric IP. */
-		error = cap_getnameinfo(g_capdns, (struct sockaddr *)saddr,
-		    saddr->sin_len, client->hostname, sizeof(client->hostname),
-		    NULL, 0, 0);
-		if (error != 0) {
-			LOGERR("cap_getnameinfo(): %s\n", gai_strerror(error));
-			goto error_out;
+static struct vmcore_buf *
+vmcore_buf_alloc(void)
+{
+	struct vmcore_buf *vb;
+
+	pthread_mutex_lock(&g_vbpool_lock);
+	vb = STAILQ_FIRST(&g_vbpool);
+	if (vb != NULL) {
+		STAILQ_REMOVE_HEAD(&g_vbpool, link);
+		g_vbpool_cnt--;
+	}
+	pthread_mutex_unlock(&g_vbpool_lock);
+
+	if (vb == NULL) {
+		vb = malloc(sizeof(*vb) + g_vbsize);
+		if (vb == NULL) {
+			LOGERR_PERROR("malloc()");
+			return (NULL);
 		}
-	} else {
-		/* Strip off the domain name. */
-		firstdot = strchr(client->hostname, '.');
-		if (firstdot)
-			*firstdot = '\0';
 	}
+	vb->off = 0;
+	vb->len = 0;
+	return (vb);
+}
+
+static void
+vmcore_buf_free(struct vmcore_buf *vb)
+{
+
+	pthread_mutex_lock(&g_vbpool_lock);
+	if (g_vbpool_cnt < g_vbpool_max) {
+		STAILQ_INSERT_HEAD(&g_vbpool, vb, link);
+		g_vbpool_cnt++;
+		vb = NULL;
+	}
+	pthread_mutex_unlock(&g_vbpool_lock);
+	free(vb);
+}
+
+/* Pick the least loaded event loop for a new client. */
+static struct netdump_worker *
+worker_select(void)
+{
+	struct netdump_worker *w;
+	int i;
+
+	if (g_nworkers == 0)
+		return (&g_dispatcher);
+
+	w = NULL;
+	pthread_mutex_lock(&g_clients_lock);
+	for (i = 0; i < g_nworkers; i++) {
+		if (g_workers[i].failed)
+			continue;
+		if (w == NULL || g_workers[i].nclients < w->nclients)
+			w = &g_workers[i];
+	}
+	pthread_mutex_unlock(&g_clients_lock);
+	return (w);
+}
+
+/*
+ * Settle the protocol extensions requested by a client in its herald. Features
+ * we don't know about are ignored, and the herald ACK tells the client which
+ * ones were accepted.
+ */
+static void
+client_negotiate(struct netdump_client *client,
+    const struct netdump_herald_ext *ext)
+{
+
+	client->datasize = NETDUMP_DATASIZE;
+	if (ext->nhe_magic != NETDUMP_EXT_MAGIC)
+		return;
+	client->ext = true;
+
+	/*
+	 * A larger payload must still leave room for a full batch of in-place
+	 * receives to be useful, so it is capped by the buffer size.
+	 */
+	if ((ext->nhe_flags & NETDUMP_EXT_DATASIZE) != 0 &&
+	    ext->nhe_datasize > NETDUMP_DATASIZE) {
+		client->datasize = MIN(ext->nhe_datasize,
+		    MIN(NETDUMP_DATASIZE_MAX, g_vbsize));
+		client->ext_flags |= NETDUMP_EXT_DATASIZE;
+	}
+	if ((ext->nhe_flags & NETDUMP_EXT_WINDOW) != 0)
+		client->ext_flags |= NETDUMP_EXT_WINDOW;
+	if ((ext->nhe_flags & NETDUMP_EXT_SACK) != 0)
+		client->ext_flags |= NETDUMP_EXT_SACK;
+
+	/*
+	 * The delay is capped well below any sensible retransmission timeout,
+	 * since the sender can't tell a delayed ACK from a lost one.
+	 */
+	if ((ext->nhe_flags & NETDUMP_EXT_DELACK) != 0 &&
+	    ext->nhe_ackpkts > 1) {
+		client->delack_pkts = MIN(ext->nhe_ackpkts, DELACK_PKTS_MAX);
+		client->delack_usec = MIN(MAX(ext->nhe_ackusec, 1),
+		    DELACK_USEC_MAX);
+		client->ext_flags |= NETDUMP_EXT_DELACK;
+	}
+	if ((ext->nhe_flags & NETDUMP_EXT_FEC) != 0 && ext->nhe_fecgroup > 1) {
+		client->fec_group = MIN(ext->nhe_fecgroup,
+		    NETDUMP_FEC_GROUP_MAX);
+		client->ext_flags |= NETDUMP_EXT_FEC;
+	}
+	if ((ext->nhe_flags & NETDUMP_EXT_LZ4) != 0 && client->fec_group == 0)
+		client->ext_flags |= NETDUMP_EXT_LZ4;
+	if ((ext->nhe_flags & NETDUMP_EXT_RESUME) != 0 && ext->nhe_token != 0) {
+		client->token = ext->nhe_token;
+		client->ext_flags |= NETDUMP_EXT_RESUME;
+	}
+}
+
+/*
+ * Pick the event loop, writer, and socket buffer size of a new client, and
+ * allocate its first vmcore buffer.
+ */
+static int
+client_setup(struct netdump_client *client)
+{
+	socklen_t optlen;
+	int bufsz;
+
+	client->worker = worker_select();
+	if (client->worker == NULL) {
+		LOGERR("No event loop available for client %s\n",
+		    client_ntoa(client));
+		return (1);
+	}
+	if (g_nwriters > 0) {
+		client->writer = &g_writers[g_nextwriter++ % g_nwriters];
+		client->ring = calloc(g_vbcount, sizeof(*client->ring));
+		client->ring_off = calloc(g_vbcount,
+		    sizeof(*client->ring_off));
+		if (client->ring == NULL || client->ring_off == NULL) {
+			LOGERR_PERROR("calloc()");
+			return (1);
+		}
+	} else
+		client->aio = atomic_load(&g_aio);
+
+	client->vb = vmcore_buf_alloc();
+	if (client->vb == NULL)
+		return (1);
 
 	/* It should be enough to hold approximatively twice the chunk size. */
 	bufsz = 128 * 1024;
@@ -403,13 +1059,83 @@ alloc_client(int sd, struct sockaddr_in *saddr, char *path)
 		    "May drop packets from %s due to small receive buffer\n",
 		    client->hostname);
 	}
+	optlen = sizeof(client->rcvbufsz);
+	if (getsockopt(client->sock, SOL_SOCKET, SO_RCVBUF, &client->rcvbufsz,
+	    &optlen) != 0) {
+		LOGERR_PERROR("getsockopt()");
+		client->rcvbufsz = bufsz;
+	}
+	return (0);
+}
+
+/*
+ * Register a client's socket with its event loop. It is not serviced until
+ * client_attach() is called.
+ */
+static int
+client_register(struct netdump_client *client)
+{
+	struct kevent event;
+
+	EV_SET(&event, client->sock, EVFILT_READ, EV_ADD | EV_DISABLE, 0, 0,
+	    client);
+	if (kevent(client->worker->kq, &event, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EV_ADD)");
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Allocate a bookkeeping structure for a new client. The client may, in its
+ * herald message, specify a path relative to the dumpdir in which to store the
+ * dump, and request protocol extensions. The client's hostname has already
+ * been resolved by the dispatcher. The client's socket is registered with its
+ * event loop but is not serviced until client_attach() is called.
+ */
+static struct netdump_client *
+alloc_client(int sd, struct sockaddr_in *saddr, const char *hostname,
+    char *path, const struct netdump_herald_ext *ext)
+{
+	struct netdump_client *client;
+	char *origpath;
+	int error;
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		LOGERR_PERROR("calloc()");
+		goto error_out;
+	}
+
+	client->corefd = client->keyfilefd = -1;
+	client->index = -1;
+	client->sock = sd;
+	atomic_init(&client->refs, 1);
+	STAILQ_INIT(&client->vbpend);
+	STAILQ_INIT(&client->aioq);
+	client->last_msg = g_dispatcher.now;
+	client->ip = saddr->sin_addr;
+	(void)inet_ntop(AF_INET, &client->ip, client->ipstr,
+	    sizeof(client->ipstr));
+	(void)strlcpy(client->hostname, hostname, sizeof(client->hostname));
+	client_negotiate(client, ext);
+
+	if (client_setup(client) != 0)
+		goto error_out;
 
 	origpath = path;
 	if (path == NULL)
 		/* g_defpath defaults to "." */
 		path = strdup(g_defpath);
 
-	error = open_client_files(client, path);
+	/* A resumable dump carries on with its saved state, if any. */
+	error = -1;
+	if (client->token != 0)
+		error = resume_open(client, path);
+	if (error == 0)
+		client->resumed = true;
+	else
+		error = open_client_files(client, path);
 	if (error != 0) {
 		if (origpath != NULL) {
 			LOGWARN(
@@ -428,15 +1154,11 @@ alloc_client(int sd, struct sockaddr_in *saddr, char *path)
 	}
 	client->path = path;
 
-	EV_SET(&event, client->sock, EVFILT_READ, EV_ADD, 0, 0, client);
-	if (kevent(g_kq, &event, 1, NULL, 0, NULL) != 0) {
-		LOGERR_PERROR("kevent(EV_ADD)");
+	if (client_register(client) != 0)
 		goto error_out;
-	}
 
-	(void)write_index(client);
-
-	LIST_INSERT_HEAD(&g_clients, client, iter);
+	if (!client->resumed)
+		(void)write_index(client);
 	return (client);
 
 error_out:
@@ -448,365 +1170,2312 @@ error_out:
 			(void)close(client->corefd);
 		if (client->sock != -1)
 			(void)close(client->sock);
+		if (client->vb != NULL)
+			vmcore_buf_free(client->vb);
+		free(client->ring);
+		free(client->ring_off);
 		free(client);
 	}
 	return (NULL);
 }
 
-static void
-free_client(struct netdump_client *client)
+/*
+ * Allocate a client servicing an additional stream of a striped transfer. It
+ * shares its parent's identity, protocol extensions, and core file.
+ */
+static struct netdump_client *
+alloc_stream(struct netdump_client *parent, int sd)
 {
-	struct kevent event;
+	struct netdump_client *client;
 
-	EV_SET(&event, client->sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-	if (kevent(g_kq, &event, 1, NULL, 0, NULL) != 0)
-		LOGERR_PERROR("kevent(EV_DELETE)");
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		LOGERR_PERROR("calloc()");
+		(void)close(sd);
+		return (NULL);
+	}
 
-	/* Remove from the list.  Ignore errors from close() routines. */
-	LIST_REMOVE(client, iter);
-	if (client->keyfilefd != -1)
-		(void)close(client->keyfilefd);
-	(void)fclose(client->infofile);
-	(void)close(client->corefd);
-	(void)close(client->sock);
-	free(client->path);
-	free(client);
+	client->parent = parent;
+	client->corefd = parent->corefd;
+	client->keyfilefd = -1;
+	client->index = -1;
+	client->sock = sd;
+	atomic_init(&client->refs, 1);
+	STAILQ_INIT(&client->vbpend);
+	STAILQ_INIT(&client->aioq);
+	client->last_msg = g_dispatcher.now;
+	client->ip = parent->ip;
+	memcpy(client->ipstr, parent->ipstr, sizeof(client->ipstr));
+	memcpy(client->hostname, parent->hostname, sizeof(client->hostname));
+	client->ext = parent->ext;
+	client->ext_flags = parent->ext_flags;
+	client->datasize = parent->datasize;
+	client->delack_pkts = parent->delack_pkts;
+	client->delack_usec = parent->delack_usec;
+	client->fec_group = parent->fec_group;
+
+	if (client_setup(client) != 0 || client_register(client) != 0) {
+		(void)close(sd);
+		if (client->vb != NULL)
+			vmcore_buf_free(client->vb);
+		free(client->ring);
+		free(client->ring_off);
+		free(client);
+		return (NULL);
+	}
+	atomic_fetch_add(&parent->refs, 1);
+	return (client);
 }
 
+/*
+ * Make a new client visible to the herald path and hand it to its event loop.
+ */
 static void
-exec_handler(struct netdump_client *client, const char *reason)
+client_attach(struct netdump_client *client)
 {
-	int error;
-
-	if (g_caphandler == NULL)
-		return;
-	error = netdump_cap_handler(g_caphandler, reason, client_ntoa(client),
-	    client->hostname, client->infofilename, client->corefilename);
-	if (error != 0)
-		LOGERR("netdump_cap_handler(): %s", strerror(error));
+	struct netdump_worker *w;
+
+	w = client->worker;
+	pthread_mutex_lock(&g_clients_lock);
+	LIST_INSERT_HEAD(CLIENT_HASH(client->ip), client, iter);
+	w->nclients++;
+	if (w != &g_dispatcher)
+		client_request(client, CLIENT_REQ_ADOPT);
+	pthread_mutex_unlock(&g_clients_lock);
+
+	if (w == &g_dispatcher)
+		client_adopt(client);
 }
 
+/* Start servicing a client from its owning event loop. */
 static void
-handle_timeout(struct netdump_client *client)
+client_adopt(struct netdump_client *client)
 {
+	struct kevent event;
+	struct netdump_worker *w;
 
-	assert(client != NULL);
+	w = client->worker;
+	LIST_INSERT_HEAD(&w->clients, client, witer);
+	w->ndumps++;
 
-	LOGINFO("Client %s timed out\n", client_ntoa(client));
-	client_pinfo(client, "Dump incomplete: client timed out\n");
-	exec_handler(client, "timeout");
-	free_client(client);
+	/* Streams time out with their dump. */
+	if (client->parent == NULL)
+		timer_arm(client, client->last_msg + client_timeout(client));
+
+	EV_SET(&event, client->sock, EVFILT_READ, EV_ENABLE, 0, 0, client);
+	if (kevent(w->kq, &event, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EV_ENABLE)");
+		handle_timeout(client);
+	}
 }
 
-static int
-vmcore_flush(struct netdump_client *client)
+/*
+ * Post a request to the event loop owning a client. The caller must ensure
+ * that the client cannot be reclaimed concurrently, either by holding the
+ * clients lock or a reference. Requests for freed clients are dropped.
+ */
+static void
+client_request(struct netdump_client *client, int req)
 {
-	ssize_t len, n;
-	off_t off;
-	int error;
+	struct netdump_worker *w;
 
-	len = client->vmcorebufoff;
-	off = 0;
-	while (len > 0) {
-		n = pwrite(client->corefd, client->vmcorebuf + off, len,
-		    client->vmcoreoff + off);
-		if (n < 0) {
-			error = errno;
-			LOGERR("pwrite (for client %s [%s]): %s\n",
-			    client->hostname, client_ntoa(client),
-			    strerror(errno));
-			if (error == EINTR)
-				continue;
-			client_pinfo(client,
-		    "Dump unsuccessful: write error @ offset %08jx: %s\n",
-			    (uintmax_t)off, strerror(errno));
-			exec_handler(client, "error");
-			free_client(client);
-			return (1);
-		}
-		len -= n;
-		off += n;
+	w = client->worker;
+	pthread_mutex_lock(&w->lock);
+	if (client->dead) {
+		pthread_mutex_unlock(&w->lock);
+		return;
 	}
-	client->vmcorebufoff = 0;
-	return (0);
+	if (client->reqs == 0)
+		STAILQ_INSERT_TAIL(&w->reqq, client, reqlink);
+	client->reqs |= req;
+	pthread_mutex_unlock(&w->lock);
+	worker_wakeup(w);
 }
 
+/*
+ * Release a client's resources. This must be called from the client's event
+ * loop. The structure itself is reclaimed by worker_reap() once the current
+ * batch of events has been processed, since later events in the batch may
+ * still refer to it, and the core file stays open until the client's writer
+ * has dropped its reference.
+ */
 static void
-timeout_clients(void)
+free_client(struct netdump_client *client)
 {
-	struct netdump_client *client, *tmp;
+	struct kevent event;
+	struct netdump_worker *w;
+	struct vmcore_buf *vb;
+	int i;
 
-	/* Only time out clients every 10 seconds. */
-	if (g_now - g_last_timeout_check < CLIENT_TPASS)
-		return;
-	g_last_timeout_check = g_now;
+	/* ACKs queued before the client was freed, e.g., for FINISHED. */
+	send_acks(client);
 
-	/* Traverse the list looking for stale clients. */
-	LIST_FOREACH_SAFE(client, &g_clients, iter, tmp) {
-		if (client->last_msg + CLIENT_TIMEOUT < g_now)
-			handle_timeout(client);
+	w = client->worker;
+	EV_SET(&event, client->sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if (kevent(w->kq, &event, 1, NULL, 0, NULL) != 0)
+		LOGERR_PERROR("kevent(EV_DELETE)");
+	if (client->ack_timer) {
+		EV_SET(&event, client->sock, EVFILT_TIMER, EV_DELETE, 0, 0,
+		    NULL);
+		if (kevent(w->kq, &event, 1, NULL, 0, NULL) != 0)
+			LOGERR_PERROR("kevent(EV_DELETE)");
 	}
-}
 
-static void
-send_ack(struct netdump_client *client, uint32_t seqno)
-{
-	struct netdump_ack ack;
+	if (g_debug && client->rcv_pkts > 0)
+		LOGINFO(
+"Client %s [%s]: %ju packets in %ju read events (%.2f packets/event, %.2f syscalls/packet)\n",
+		    client->hostname, client_ntoa(client),
+		    (uintmax_t)client->rcv_pkts, (uintmax_t)client->rcv_events,
+		    (double)client->rcv_pkts / client->rcv_events,
+		    (double)client->rcv_syscalls / client->rcv_pkts);
+	if (g_debug && client->ack_pkts > 0)
+		LOGINFO(
+"Client %s [%s]: %ju ACKs in %ju send syscalls (%.2f syscalls/MB)\n",
+		    client->hostname, client_ntoa(client),
+		    (uintmax_t)client->ack_pkts,
+		    (uintmax_t)client->ack_syscalls,
+		    (double)client->ack_syscalls /
+		    MAX((double)client->vmcore_rcvd / (1024 * 1024), 1.0));
+	if (g_debug && client->ack_queued > 0)
+		LOGINFO(
+"Client %s [%s]: %ju ACKs queued on a full socket, %ju retried, %ju dropped\n",
+		    client->hostname, client_ntoa(client),
+		    (uintmax_t)client->ack_queued,
+		    (uintmax_t)client->ack_retried,
+		    (uintmax_t)client->ack_dropped);
+	if (g_debug && (client->ext_flags & NETDUMP_EXT_DELACK) != 0)
+		LOGINFO(
+"Client %s [%s]: %.2f packets/ACK with delayed ACKs, %ju sent by the timer\n",
+		    client->hostname, client_ntoa(client),
+		    (double)client->rcv_pkts / MAX(client->ack_pkts, 1),
+		    (uintmax_t)client->ack_expired);
+	if (g_debug && client->ack_updates > 0)
+		LOGINFO("Client %s [%s]: %ju window updates sent\n",
+		    client->hostname, client_ntoa(client),
+		    (uintmax_t)client->ack_updates);
+	if (g_debug && client->vmcore_rcvd > 0)
+		LOGINFO(
+"Client %s [%s]: %ju of %ju vmcore bytes copied, %ju duplicate, %ju packets held for reordering\n",
+		    client->hostname, client_ntoa(client),
+		    (uintmax_t)client->vmcore_copied,
+		    (uintmax_t)client->vmcore_rcvd,
+		    (uintmax_t)client->vmcore_dup,
+		    (uintmax_t)client->vmcore_held);
+
+	/* Remove from the lists.  Ignore errors from close() routines. */
+	pthread_mutex_lock(&g_clients_lock);
+	LIST_REMOVE(client, iter);
+	w->nclients--;
+	pthread_mutex_lock(&w->lock);
+	if (client->reqs != 0) {
+		STAILQ_REMOVE(&w->reqq, client, netdump_client, reqlink);
+		client->reqs = 0;
+	}
+	client->dead = true;
+	pthread_mutex_unlock(&w->lock);
+	pthread_mutex_unlock(&g_clients_lock);
+	LIST_REMOVE(client, witer);
+	timer_cancel(client);
 
-	bzero(&ack, sizeof(ack));
-	ack.na_seqno = htonl(seqno);
+	/*
+	 * A dump's streams go with it, and a stream going away on its own
+	 * fails the dump.
+	 */
+	for (i = 1; i < client->nstreams; i++) {
+		client_request(client->streams[i], CLIENT_REQ_EXPIRE);
+		client_rele(client->streams[i]);
+	}
+	client->nstreams = 0;
+	if (client->parent != NULL && !client->expiring)
+		client_request(client->parent, CLIENT_REQ_SFAIL);
 
-	if (send(client->sock, &ack, sizeof(ack), 0) == -1)
-		LOGERR_PERROR("send()");
 	/*
-	 * XXX: On EAGAIN, we should probably queue the packet
-	 * to be sent when the socket is writable but
-	 * that is too much effort, since it is mostly
-	 * harmless to wait for the client to retransmit.
+	 * Wait for in-flight asynchronous writes, since they refer to our
+	 * buffers. Reaping them also removes their pending completion events.
 	 */
+	while ((vb = STAILQ_FIRST(&client->aioq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&client->aioq, link);
+		vmcore_aio_wait(vb);
+		vmcore_buf_free(vb);
+	}
+
+	/* Buffered data not yet queued to the writer is discarded. */
+	while ((vb = STAILQ_FIRST(&client->vbpend)) != NULL) {
+		STAILQ_REMOVE_HEAD(&client->vbpend, link);
+		vmcore_buf_free(vb);
+	}
+	vmcore_buf_free(client->vb);
+	client->vb = NULL;
+	free(client->reorder);
+	free(client->fec);
+	free(client->rcvd.ext);
+
+	if (client->keyfilefd != -1)
+		(void)close(client->keyfilefd);
+	if (client->infofile != NULL)
+		(void)fclose(client->infofile);
+	(void)close(client->sock);
+	free(client->path);
+	LIST_INSERT_HEAD(&w->dead, client, witer);
 }
 
+/* Drop a reference to a client, freeing it once the last one is gone. */
 static void
-handle_kdh(struct netdump_client *client, struct netdump_pkt *pkt)
+client_rele(struct netdump_client *client)
 {
-#if KERNELDUMPVERSION >= 3
-	static const char *const compalgos[] = {
-	    [KERNELDUMP_COMP_NONE] = "none",
-	    [KERNELDUMP_COMP_GZIP] = "gzip",
-#ifdef KERNELDUMP_COMP_ZSTD
-	    [KERNELDUMP_COMP_ZSTD] = "zstd",
-#endif
-	    NULL,
-	};
-	static const char *const suffixes[] = {
-	    [KERNELDUMP_COMP_GZIP] = ".gz",
-#ifdef KERNELDUMP_COMP_ZSTD
-	    [KERNELDUMP_COMP_ZSTD] = ".zst",
-#endif
-	};
-	const char *compalgo;
-#endif /* KERNELDUMPVERSION >= 3 */
-#if KERNELDUMPVERSION >= 2
-	char newpath[MAXPATHLEN];
-	char *p;
-	int limit;
-#endif
-	struct kerneldumpheader *kdh;
-	uint64_t dumplen;
-	time_t t;
-	int parity_check;
+	uint64_t tail;
 
-	client->any_data_rcvd = true;
+	if (atomic_fetch_sub(&client->refs, 1) != 1)
+		return;
+	if (client->ring != NULL) {
+		for (tail = atomic_load(&client->ring_tail);
+		    tail != atomic_load(&client->ring_head); tail++)
+			vmcore_buf_free(client->ring[tail % g_vbcount]);
+		free(client->ring);
+	}
+	free(client->ring_off);
+	if (client->parent != NULL)
+		client_rele(client->parent);
+	else
+		(void)close(client->corefd);
+	free(client);
+}
 
-	LOGINFO("(KDH from %s [%s])\n", client->hostname, client_ntoa(client));
-	send_ack(client, pkt->hdr.mh_seqno);
+static void
+exec_handler(struct netdump_client *client, const char *reason)
+{
+	int error;
 
-	if (pkt->hdr.mh_len < sizeof(struct kerneldumpheader)) {
-		LOGERR("Bad KDH from %s [%s]: packet too small\n",
-		    client->hostname, client_ntoa(client));
-		client_pinfo(client, "Bad KDH: packet too small\n");
+	if (g_caphandler == NULL || client->parent != NULL)
 		return;
-	}
+	pthread_mutex_lock(&g_caphandler_lock);
+	error = netdump_cap_handler(g_caphandler, reason, client_ntoa(client),
+	    client->hostname, client->infofilename, client->corefilename);
+	pthread_mutex_unlock(&g_caphandler_lock);
+	if (error != 0)
+		LOGERR("netdump_cap_handler(): %s", strerror(error));
+}
 
-	kdh = (struct kerneldumpheader *)(void *)pkt->data;
+static void
+handle_timeout(struct netdump_client *client)
+{
 
-	parity_check = kerneldump_parity(kdh);
+	assert(client != NULL);
 
-	/* Make sure all the strings are null-terminated. */
-	kdh->architecture[sizeof(kdh->architecture) - 1] = '\0';
-	kdh->hostname[sizeof(kdh->hostname) - 1] = '\0';
-	kdh->versionstring[sizeof(kdh->versionstring) - 1] = '\0';
-	kdh->panicstring[sizeof(kdh->panicstring) - 1] = '\0';
+	LOGINFO("Client %s timed out\n", client_ntoa(client));
+	if (client->token != 0 && client->parent == NULL &&
+	    resume_save(client) != 0)
+		return;
+	client_pinfo(client, "Dump incomplete: client timed out\n");
+	exec_handler(client, "timeout");
+	free_client(client);
+}
 
-	client_pinfo(client, "  Architecture: %s\n", kdh->architecture);
-	client_pinfo(client, "  Architecture version: %d\n",
-	    dtoh32(kdh->architectureversion));
-	dumplen = dtoh64(kdh->dumplength);
-	client_pinfo(client, "  Dump length: %lldB (%lld MB)\n",
-	    (long long)dumplen, (long long)(dumplen >> 20));
-	client_pinfo(client, "  Blocksize: %d\n", dtoh32(kdh->blocksize));
-	t = dtoh64(kdh->dumptime);
-#if KERNELDUMPVERSION >= 3
-	if (kdh->version >= 3) {
-		if (kdh->compression < nitems(compalgos))
-			compalgo = compalgos[kdh->compression];
-		else
-			compalgo = "???";
-		client_pinfo(client, "  Compression: %s\n", compalgo);
+/* Return true if the given range contains only zero bytes. */
+static bool
+is_zero(const uint8_t *p, size_t len)
+{
+	uint64_t word;
+	size_t i;
+
+	i = 0;
+#if defined(__AVX2__)
+	for (; i + 128 <= len; i += 128) {
+		__m256i v;
+
+		v = _mm256_or_si256(
+		    _mm256_or_si256(
+			_mm256_loadu_si256((const __m256i *)(p + i)),
+			_mm256_loadu_si256((const __m256i *)(p + i + 32))),
+		    _mm256_or_si256(
+			_mm256_loadu_si256((const __m256i *)(p + i + 64)),
+			_mm256_loadu_si256((const __m256i *)(p + i + 96))));
+		if (!_mm256_testz_si256(v, v))
+			return (false);
 	}
-#endif
-	client_pinfo(client, "  Dumptime: %s", ctime(&t));
-	client_pinfo(client, "  Hostname: %s\n", kdh->hostname);
-	client_pinfo(client, "  Versionstring: %s", kdh->versionstring);
-	client_pinfo(client, "  Panicstring: %s\n", kdh->panicstring);
-	client_pinfo(client, "  Header parity check: %s\n",
-	    parity_check ? "Fail" : "Pass");
-	fflush(client->infofile);
-
-#if KERNELDUMPVERSION >= 2
-	if (kdh->version >= 2 && kdh->dumpkeysize > 0) {
-		(void)strlcpy(newpath, client->corefilename, sizeof(newpath));
-		p = strrchr(newpath, '/');
-		if (p == NULL ||
-		    strncmp(p + 1, "vmcore.", 7) != 0)
-			LOGWARN("Corrupted core file path '%s'\n",
-			    client->corefilename);
-		else {
-			p++;
-			limit = sizeof(newpath) - (p - &newpath[0]);
-			if (snprintf(p, limit, "vmcore_encrypted.%s.%d",
-			    client->hostname, client->index) < limit) {
-				renameat(g_dumpdir_fd, client->corefilename,
-				    g_dumpdir_fd, newpath);
-				(void)strlcpy(client->corefilename, newpath,
-				    sizeof(client->corefilename));
-			} else
-				LOGWARN(
-			    "Couldn't append encryption suffix to '%s'\n",
-				    client->corefilename);
-		}
+#elif defined(__SSE2__)
+	for (; i + 64 <= len; i += 64) {
+		__m128i v;
+
+		v = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+			_mm_loadu_si128((const __m128i *)(p + i + 16))),
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+			_mm_loadu_si128((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) !=
+		    0xffff)
+			return (false);
 	}
-#endif
-#if KERNELDUMPVERSION >= 3
-	/*
-	 * Rename the dump file so that it has the correct suffix, and truncate
-	 * it to the correct size. The kernel dump code always writes in
-	 * multiples of the block size, so the resulting file size will be
-	 * rounded up to the next multiple. The trailing bytes confuse
-	 * decompressors, so chop them off now. This is a bit of a hack, but so
-	 * it goes.
-	 */
-	if (kdh->version >= 3 && kdh->compression < nitems(compalgos) &&
-	    kdh->compression != KERNELDUMP_COMP_NONE) {
-		(void)strlcpy(newpath, client->corefilename, sizeof(newpath));
-		if (strlcat(newpath, suffixes[kdh->compression],
-		    sizeof(newpath)) < sizeof(newpath)) {
-			renameat(g_dumpdir_fd, client->corefilename,
-			    g_dumpdir_fd, newpath);
-			(void)strlcpy(client->corefilename, newpath,
-			    sizeof(client->corefilename));
-		} else
-			LOGWARN("Couldn't append compression suffix to '%s'\n",
-			    client->corefilename);
-
-		if (vmcore_flush(client) == 0 &&
-		    ftruncate(client->corefd, dumplen) != 0)
-			/* Not fatal. */
-			LOGERR_PERROR("ftruncate()");
+#elif defined(__ARM_NEON)
+	for (; i + 64 <= len; i += 64) {
+		uint64x2_t v;
+
+		v = vreinterpretq_u64_u8(vorrq_u8(
+		    vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+		    vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48))));
+		if ((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) != 0)
+			return (false);
 	}
 #endif
+	for (; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, p + i, sizeof(word));
+		if (word != 0)
+			return (false);
+	}
+	for (; i < len; i++)
+		if (p[i] != 0)
+			return (false);
+	return (true);
 }
 
-static void
-handle_ekcd_key(struct netdump_client *client, struct netdump_pkt *pkt)
+/* Return true if the block of a buffer starting at the given offset is zero. */
+static bool
+vmcore_zero_block(const struct vmcore_buf *vb, ssize_t off)
 {
-	char *data;
-	ssize_t n;
-	uint32_t bytes, offset;
-	int fd;
 
-	if (client->keyfilefd == -1) {
-		char keyfile[MAXPATHLEN];
-		size_t len;
+	return (is_zero(vb->data + off, MIN(ZERO_BLKSZ, vb->len - off)));
+}
 
-		len = snprintf(keyfile, sizeof(keyfile), "%s/key.%s.%d",
-		    client->path, client->hostname, client->index);
-		if (len >= sizeof(keyfile)) {
-			LOGERR(
-			    "Truncated key file path for client %s [%s]: %s\n",
-			    client->hostname, client_ntoa(client), keyfile);
-			return;
-		}
+/*
+ * Write out a range of vmcore data. Returns 0 on success, or an error number,
+ * in which case *erroffp is set to the file offset at which the write failed.
+ */
+static int
+vmcore_pwrite(struct netdump_client *client, const uint8_t *buf, ssize_t len,
+    off_t off, off_t *erroffp)
+{
+	ssize_t n;
+	int error;
 
-		fd = openat(g_dumpdir_fd, keyfile,
-		    O_WRONLY | O_CREAT | O_CLOEXEC, 0400);
-		if (fd < 0) {
-			LOGERR_PERROR("openat()");
-			return;
+	while (len > 0) {
+		n = pwrite(client->corefd, buf, len, off);
+		if (n < 0) {
+			error = errno;
+			LOGERR("pwrite (for client %s [%s]): %s\n",
+			    client->hostname, client_ntoa(client),
+			    strerror(error));
+			if (error == EINTR)
+				continue;
+			*erroffp = off;
+			return (error);
 		}
-		client->keyfilefd = fd;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return (0);
+}
 
-		LOGINFO("(EKCD key from %s [%s])\n",
-		    client->hostname, client_ntoa(client));
-	} else
-		fd = client->keyfilefd;
+/*
+ * Write out a buffer of vmcore data, skipping blocks of zeroes so that they
+ * are left as holes in the core file. Returns 0 on success, or an error number,
+ * in which case *erroffp is set to the file offset at which the write failed.
+ */
+static int
+vmcore_write(struct netdump_client *client, struct vmcore_buf *vb,
+    off_t *erroffp)
+{
+	ssize_t end, start;
+	int error;
 
-	bytes = pkt->hdr.mh_len;
-	data = pkt->data;
-	offset = pkt->hdr.mh_offset;
-	do {
-		n = pwrite(fd, data, bytes, offset);
-		if (n < 0) {
-			LOGERR_PERROR("write()");
-			return;
+	for (start = 0; start < vb->len; start = end) {
+		end = MIN(start + ZERO_BLKSZ, vb->len);
+		if (vmcore_zero_block(vb, start)) {
+			client->zero_skipped += end - start;
+			continue;
 		}
-		bytes -= n;
-		data += n;
-		offset += n;
-	} while (bytes > 0);
+		while (end < vb->len && !vmcore_zero_block(vb, end))
+			end = MIN(end + ZERO_BLKSZ, vb->len);
+		error = vmcore_pwrite(client, vb->data + start, end - start,
+		    vb->off + start, erroffp);
+		if (error != 0)
+			return (error);
+	}
+	return (0);
+}
 
-	send_ack(client, pkt->hdr.mh_seqno);
+/*
+ * Zero blocks skipped at the end of the dump leave the core file short, so
+ * extend it to the length of the data received, or to the length given by the
+ * kernel dump header if that is shorter.
+ */
+static void
+vmcore_extend(struct netdump_client *client)
+{
+	struct stat sb;
+	off_t end;
+
+	end = client->extent_end;
+	if (client->truncated && client->trunclen < end)
+		end = client->trunclen;
+	if (fstat(client->corefd, &sb) != 0) {
+		LOGERR_PERROR("fstat()");
+		return;
+	}
+	if (sb.st_size < end && ftruncate(client->corefd, end) != 0)
+		LOGERR_PERROR("ftruncate()");
 }
 
 static void
-handle_vmcore(struct netdump_client *client, struct netdump_pkt *pkt)
+vmcore_error(struct netdump_client *client, int error, off_t off)
 {
 
-	client->any_data_rcvd = true;
-	if (pkt->hdr.mh_seqno % (16 * 1024 * 1024 / 1456) == 0) {
+	client_pinfo(client,
+	    "Dump unsuccessful: write error @ offset %08jx: %s\n",
+	    (uintmax_t)off, strerror(error));
+	exec_handler(client, "error");
+	free_client(client);
+}
+
+/*
+ * Hand off the buffered vmcore data for writing and start a new buffer. Without
+ * writer threads, the data is written out immediately. Returns 1 if the client
+ * was freed as a result of an error, 0 otherwise.
+ */
+static int
+vmcore_flush(struct netdump_client *client)
+{
+	struct vmcore_buf *vb;
+	off_t off;
+	int error;
+
+	if (client->vb->len == 0)
+		return (0);
+
+	if (client->writer == NULL && !client->aio) {
+		error = vmcore_write(client, client->vb, &off);
+		if (error != 0) {
+			vmcore_error(client, error, off);
+			return (1);
+		}
+		client->vb->len = 0;
+		return (0);
+	}
+
+	/*
+	 * The full buffer may still hold payloads from the batch being
+	 * processed, so it is queued for writing by vmcore_commit() once the
+	 * batch is done.
+	 */
+	vb = vmcore_buf_alloc();
+	if (vb == NULL) {
+		client_pinfo(client, "Dump unsuccessful: out of memory\n");
+		exec_handler(client, "error");
+		free_client(client);
+		return (1);
+	}
+	STAILQ_INSERT_TAIL(&client->vbpend, client->vb, link);
+	client->vb = vb;
+	return (0);
+}
+
+/*
+ * Truncate the core file once all data buffered so far has been written.
+ * Returns 1 if the client was freed as a result of an error, 0 otherwise.
+ */
+static int
+vmcore_truncate(struct netdump_client *client, off_t len)
+{
+
+	if (vmcore_flush(client) != 0 ||
+	    vmcore_reorder_write(client, OFF_MAX) != 0)
+		return (1);
+	client->trunclen = len;
+	client->truncated = true;
+	if (client->writer != NULL || client->aio)
+		client->wctl_pending |= WCTL_TRUNCATE;
+	else if (ftruncate(client->corefd, len) != 0)
+		/* Not fatal. */
+		LOGERR_PERROR("ftruncate()");
+	return (0);
+}
+
+/* Schedule a client's writer to service it. */
+static void
+writer_notify(struct netdump_client *client)
+{
+	struct netdump_writer *wr;
+
+	wr = client->writer;
+	pthread_mutex_lock(&wr->lock);
+	if (!client->wqueued) {
+		client->wqueued = true;
+		atomic_fetch_add(&client->refs, 1);
+		STAILQ_INSERT_TAIL(&wr->runq, client, wlink);
+		pthread_cond_signal(&wr->cv);
+	}
+	pthread_mutex_unlock(&wr->lock);
+}
+
+/* Stop or resume reading from a client's socket. */
+static void
+client_rdisable(struct netdump_client *client, bool rdisable)
+{
+	struct kevent event;
+
+	if (rdisable == client->rdisabled)
+		return;
+	EV_SET(&event, client->sock, EVFILT_READ,
+	    rdisable ? EV_DISABLE : EV_ENABLE, 0, 0, client);
+	if (kevent(client->worker->kq, &event, 1, NULL, 0, NULL) != 0)
+		LOGERR_PERROR("kevent()");
+	client->rdisabled = rdisable;
+}
+
+/*
+ * Submit an asynchronous write of a full buffer. Leading and trailing blocks of
+ * zeroes are trimmed so that they are left as holes in the core file, and a
+ * buffer of zeroes is not written at all. If the submission fails, the buffer
+ * is written synchronously instead, and asynchronous I/O is turned off for new
+ * clients if the kernel does not support it for the core file. Returns 1 if the
+ * client was freed as a result of an error, 0 otherwise.
+ */
+static int
+vmcore_aio_submit(struct netdump_client *client, struct vmcore_buf *vb)
+{
+	struct aiocb *aiocb;
+	ssize_t blk, end, start;
+	off_t off;
+	int error;
+
+	for (start = 0; start < vb->len && vmcore_zero_block(vb, start);
+	    start += ZERO_BLKSZ)
+		;
+	if (start >= vb->len) {
+		client->zero_skipped += vb->len;
+		vmcore_buf_free(vb);
+		return (0);
+	}
+	end = vb->len;
+	while ((blk = rounddown(end - 1, ZERO_BLKSZ)) > start &&
+	    vmcore_zero_block(vb, blk))
+		end = blk;
+	client->zero_skipped += start + (vb->len - end);
+
+	aiocb = &vb->aiocb;
+	memset(aiocb, 0, sizeof(*aiocb));
+	aiocb->aio_fildes = client->corefd;
+	aiocb->aio_buf = vb->data + start;
+	aiocb->aio_nbytes = end - start;
+	aiocb->aio_offset = vb->off + start;
+	aiocb->aio_sigevent.sigev_notify = SIGEV_KEVENT;
+	aiocb->aio_sigevent.sigev_notify_kqueue = client->worker->kq;
+	aiocb->aio_sigevent.sigev_value.sival_ptr = client;
+	if (aio_write(aiocb) == 0) {
+		STAILQ_INSERT_TAIL(&client->aioq, vb, link);
+		client->aio_inflight++;
+		return (0);
+	}
+
+	error = errno;
+	if (error == ENOSYS || error == EOPNOTSUPP) {
+		if (atomic_exchange(&g_aio, false))
+			LOGWARN("aio_write(): %s; using synchronous writes\n",
+			    strerror(error));
+	} else if (error != EAGAIN)
+		LOGERR("aio_write (for client %s [%s]): %s\n",
+		    client->hostname, client_ntoa(client), strerror(error));
+	error = vmcore_pwrite(client, vb->data + start, end - start,
+	    vb->off + start, &off);
+	vmcore_buf_free(vb);
+	if (error != 0) {
+		vmcore_error(client, error, off);
+		return (1);
+	}
+	return (0);
+}
+
+/* Wait for an asynchronous write to complete, and reap it. */
+static ssize_t
+vmcore_aio_wait(struct vmcore_buf *vb)
+{
+	const struct aiocb *list[1];
+
+	list[0] = &vb->aiocb;
+	while (aio_error(&vb->aiocb) == EINPROGRESS)
+		(void)aio_suspend(list, 1, NULL);
+	return (aio_return(&vb->aiocb));
+}
+
+/*
+ * Submit queued buffers, up to g_vbcount writes in flight, and carry
+ * out control requests once every write preceding them has completed. Reads
+ * from the client's socket are disabled while buffers are waiting to be
+ * submitted.
+ */
+static void
+vmcore_aio_commit(struct netdump_client *client)
+{
+	struct vmcore_buf *vb;
+	int ctl;
+
+	while (client->aio_inflight < g_vbcount &&
+	    (vb = STAILQ_FIRST(&client->vbpend)) != NULL) {
+		STAILQ_REMOVE_HEAD(&client->vbpend, link);
+		if (vmcore_aio_submit(client, vb) != 0)
+			return;
+	}
+	client_rdisable(client, !STAILQ_EMPTY(&client->vbpend));
+
+	if (client->aio_inflight > 0 || client->wctl_pending == 0)
+		return;
+	ctl = client->wctl_pending;
+	client->wctl_pending = 0;
+	if ((ctl & WCTL_TRUNCATE) != 0 &&
+	    ftruncate(client->corefd, client->trunclen) != 0)
+		/* Not fatal. */
+		LOGERR_PERROR("ftruncate()");
+	if ((ctl & WCTL_SYNC) != 0) {
+		vmcore_extend(client);
+		if (fsync(client->corefd) != 0)
+			/* Not fatal. */
+			LOGERR_PERROR("fsync()");
+		(void)client_finish(client);
+	}
+}
+
+/*
+ * Handle the completion of an asynchronous write. A short write is resubmitted
+ * for the remainder of the range.
+ */
+static void
+vmcore_aio_done(struct netdump_client *client, struct aiocb *aiocb)
+{
+	struct vmcore_buf *vb;
+	ssize_t n, start;
+	off_t off;
+	int error;
+
+	vb = __containerof(aiocb, struct vmcore_buf, aiocb);
+	error = aio_error(aiocb);
+	if (error == EINPROGRESS)
+		return;
+	n = aio_return(aiocb);
+	STAILQ_REMOVE(&client->aioq, vb, vmcore_buf, link);
+	client->aio_inflight--;
+
+	if (error != 0) {
+		LOGERR("aio_write (for client %s [%s]): %s\n",
+		    client->hostname, client_ntoa(client), strerror(error));
+		off = aiocb->aio_offset;
+		vmcore_buf_free(vb);
+		vmcore_error(client, error, off);
+		return;
+	}
+	if (n < (ssize_t)aiocb->aio_nbytes) {
+		start = aiocb->aio_offset - vb->off + n;
+		vb->off += start;
+		vb->len = aiocb->aio_nbytes - n;
+		memmove(vb->data, vb->data + start, vb->len);
+		STAILQ_INSERT_HEAD(&client->vbpend, vb, link);
+	} else
+		vmcore_buf_free(vb);
+	vmcore_aio_commit(client);
+	client_window_update(client);
+}
+
+/*
+ * Queue full buffers and then any control requests for writing. This is called
+ * once all packets in a batch have been processed. While buffers are waiting
+ * for room in the writer's ring, reads from the client's socket are disabled;
+ * the writer posts a resume request once it has freed a slot.
+ */
+static void
+vmcore_commit(struct netdump_client *client)
+{
+	struct vmcore_buf *vb;
+	uint64_t head;
+	bool notify;
+
+	if (client->aio) {
+		vmcore_aio_commit(client);
+		return;
+	}
+	if (client->writer == NULL)
+		return;
+
+	notify = false;
+again:
+	head = atomic_load(&client->ring_head);
+	while ((vb = STAILQ_FIRST(&client->vbpend)) != NULL &&
+	    head - atomic_load(&client->ring_tail) < (uint64_t)g_vbcount) {
+		STAILQ_REMOVE_HEAD(&client->vbpend, link);
+		client->ring[head % g_vbcount] = vb;
+		client->ring_off[head % g_vbcount] = vb->off;
+		atomic_store(&client->ring_head, ++head);
+		notify = true;
+	}
+	if (STAILQ_EMPTY(&client->vbpend)) {
+		if (client->wctl_pending != 0) {
+			atomic_fetch_or(&client->wctl, client->wctl_pending);
+			client->wctl_pending = 0;
+			notify = true;
+		}
+	} else {
+		/*
+		 * The ring is full. Ask the writer for a resume request, then
+		 * check again in case it drained the ring in the meantime.
+		 */
+		atomic_store(&client->wstalled, true);
+		if (head - atomic_load(&client->ring_tail) <
+		    (uint64_t)g_vbcount) {
+			atomic_store(&client->wstalled, false);
+			goto again;
+		}
+	}
+	if (notify)
+		writer_notify(client);
+	client_rdisable(client, !STAILQ_EMPTY(&client->vbpend));
+}
+
+/* Write out the buffers queued in a client's ring. */
+static void
+writer_drain(struct netdump_writer *wr, struct netdump_client *client)
+{
+	struct vmcore_buf *vb;
+	off_t off;
+	uint64_t tail;
+	int error;
+
+	tail = atomic_load(&client->ring_tail);
+	while (tail != atomic_load(&client->ring_head)) {
+		vb = client->ring[tail % g_vbcount];
+		if (!atomic_load(&client->werror)) {
+			error = vmcore_write(client, vb, &off);
+			if (error == 0) {
+				wr->nwrites++;
+				wr->wbytes += vb->len;
+			} else {
+				client->werrno = error;
+				client->werroff = off;
+				atomic_store(&client->werror, true);
+				client_request(client, CLIENT_REQ_WERROR);
+			}
+		}
+		vmcore_buf_free(vb);
+		atomic_store(&client->ring_tail, ++tail);
+		if (atomic_exchange(&client->wstalled, false))
+			client_request(client, CLIENT_REQ_RESUME);
+	}
+}
+
+static void
+writer_service(struct netdump_writer *wr, struct netdump_client *client)
+{
+	int ctl;
+
+	writer_drain(wr, client);
+	ctl = atomic_exchange(&client->wctl, 0);
+	if (ctl == 0)
+		return;
+
+	/* Buffers queued ahead of the request must be written first. */
+	writer_drain(wr, client);
+	if (atomic_load(&client->werror))
+		return;
+	if ((ctl & WCTL_TRUNCATE) != 0 &&
+	    ftruncate(client->corefd, client->trunclen) != 0)
+		/* Not fatal. */
+		LOGERR_PERROR("ftruncate()");
+	if ((ctl & WCTL_SYNC) != 0) {
+		vmcore_extend(client);
+		if (fsync(client->corefd) != 0)
+			/* Not fatal. */
+			LOGERR_PERROR("fsync()");
+		client_request(client, CLIENT_REQ_SYNCED);
+	}
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct netdump_client *client;
+	struct netdump_writer *wr;
+
+	wr = arg;
+	pthread_mutex_lock(&wr->lock);
+	for (;;) {
+		while ((client = STAILQ_FIRST(&wr->runq)) == NULL &&
+		    !wr->exiting)
+			pthread_cond_wait(&wr->cv, &wr->lock);
+		if (client == NULL)
+			break;
+		STAILQ_REMOVE_HEAD(&wr->runq, wlink);
+		client->wqueued = false;
+		pthread_mutex_unlock(&wr->lock);
+
+		writer_service(wr, client);
+		client_rele(client);
+
+		pthread_mutex_lock(&wr->lock);
+	}
+	pthread_mutex_unlock(&wr->lock);
+
+	if (wr->nwrites > 0)
+		LOGINFO("Writer %d: %ju writes, %ju bytes\n", wr->id,
+		    (uintmax_t)wr->nwrites, (uintmax_t)wr->wbytes);
+	return (NULL);
+}
+
+/*
+ * How long a dump may go without a message before it is given up on. Hosts
+ * that heralded but sent nothing are dropped quickly; once data flows, the
+ * timeout follows the longest gap seen between the client's messages. Clients
+ * waiting on us rather than the other way round get the full timeout.
+ */
+static time_t
+client_timeout(const struct netdump_client *client)
+{
+
+	if (client->rdisabled || client->finishing ||
+	    client->aio_inflight > 0 || atomic_load(&client->streams_busy) > 0)
+		return (CLIENT_TIMEOUT);
+	if (!atomic_load(&client->any_data_rcvd))
+		return (CLIENT_TIMEOUT_IDLE);
+	return (MIN(CLIENT_TIMEOUT, MAX(CLIENT_TIMEOUT_MIN,
+	    CLIENT_GAP_MULT * client->max_gap)));
+}
+
+/* Schedule a client's timeout check, no earlier than the next tick. */
+static void
+timer_arm(struct netdump_client *client, time_t deadline)
+{
+	struct netdump_worker *w;
+
+	w = client->worker;
+	client->deadline = MAX(deadline, w->wheel_tick);
+	LIST_INSERT_HEAD(&w->wheel[client->deadline % WHEEL_SLOTS], client,
+	    tlink);
+	client->timer_armed = true;
+	w->ntimers++;
+}
+
+static void
+timer_cancel(struct netdump_client *client)
+{
+
+	if (!client->timer_armed)
+		return;
+	LIST_REMOVE(client, tlink);
+	client->timer_armed = false;
+	client->worker->ntimers--;
+}
+
+/*
+ * Advance the timer wheel to the current time. Clients whose deadline passed
+ * are timed out, unless they were heard from since it was set, in which case
+ * the check is pushed back.
+ */
+static void
+timeout_clients(struct netdump_worker *w)
+{
+	struct netdump_client *client, *tmp;
+	uint64_t bytes;
+	time_t last, tick;
+
+	if (g_debug && w->now - w->last_timeout_check >= CLIENT_TPASS) {
+		if (w->rcv_bytes != w->rcv_bytes_last) {
+			bytes = w->rcv_bytes - w->rcv_bytes_last;
+			LOGINFO(
+		    "Worker %d: %ju bytes received in %jds (%.2f MB/s)\n",
+			    w->id, (uintmax_t)bytes,
+			    (intmax_t)(w->now - w->last_timeout_check),
+			    (double)bytes / (w->now - w->last_timeout_check) /
+			    (1024 * 1024));
+			w->rcv_bytes_last = w->rcv_bytes;
+		}
+		if (w == &g_dispatcher)
+			herald_latency_report();
+		w->last_timeout_check = w->now;
+	}
+
+	/* After a clock jump, one turn of the wheel covers every deadline. */
+	if (w->now - w->wheel_tick >= WHEEL_SLOTS)
+		w->wheel_tick = w->now - WHEEL_SLOTS + 1;
+	while (w->wheel_tick <= w->now) {
+		tick = w->wheel_tick++;
+		LIST_FOREACH_SAFE(client, &w->wheel[tick % WHEEL_SLOTS], tlink,
+		    tmp) {
+			/* Due on a later turn of the wheel. */
+			if (client->deadline > tick)
+				continue;
+			timer_cancel(client);
+			last = MAX(client->last_msg,
+			    (time_t)atomic_load(&client->stream_msg));
+			if (last + client_timeout(client) > w->now) {
+				timer_arm(client, last + client_timeout(client));
+				continue;
+			}
+			handle_timeout(client);
+		}
+	}
+}
+
+/*
+ * Compute the window advertised to a client: the VMCORE payload we can absorb
+ * without dropping packets. That is bounded by the room left in the socket's
+ * receive buffer and, when writes are asynchronous, by the room left for
+ * buffered data before reads from the socket are stopped.
+ */
+static uint32_t
+client_window(struct netdump_client *client)
+{
+	struct vmcore_buf *vb;
+	int64_t bufs, room;
+	int queued;
+
+	if (ioctl(client->sock, FIONREAD, &queued) != 0)
+		queued = 0;
+	room = client->rcvbufsz - queued;
+
+	if (client->writer != NULL || client->aio) {
+		bufs = g_vbcount - (client->aio ? client->aio_inflight :
+		    (int64_t)(atomic_load(&client->ring_head) -
+		    atomic_load(&client->ring_tail)));
+		STAILQ_FOREACH(vb, &client->vbpend, link)
+			bufs--;
+		room = MIN(room, (int64_t)g_vbsize * MAX(bufs, 0) +
+		    ((int64_t)g_vbsize - client->vb->len));
+	}
+	return ((uint32_t)MIN(MAX(room, 0), UINT32_MAX));
+}
+
+/*
+ * Tell a client whose window had closed that it has reopened, by repeating the
+ * last ACK. This is called once buffered data has been handed off for writing,
+ * since the client has nothing else to wait for. A writer only posts a resume
+ * request for a stalled client, so a client with a closed window is marked as
+ * such.
+ */
+static void
+client_window_update(struct netdump_client *client)
+{
+
+	if (client->dead || (client->ext_flags & NETDUMP_EXT_WINDOW) == 0 ||
+	    client->ack_window >= client->datasize)
+		return;
+	if (client_window(client) < client->datasize) {
+		if (client->writer == NULL)
+			return;
+		atomic_store(&client->wstalled, true);
+		if (client_window(client) < client->datasize)
+			return;
+		atomic_store(&client->wstalled, false);
+	}
+	client->ack_updates++;
+	send_ack(client, client->ack_seqno);
+}
+
+static void
+send_ack(struct netdump_client *client, uint32_t seqno)
+{
+
+	/*
+	 * While a batch of packets is being processed, ACKs are queued and
+	 * sent together once the batch is done. Each still acknowledges a
+	 * single packet.
+	 */
+	client->ackq[client->nacks++] = seqno;
+	client->ack_seqno = seqno;
+	if (!client->ack_batching || client->nacks == nitems(client->ackq))
+		send_acks(client);
+}
+
+/* Return true if a seqno past the cumulative ACK was received. */
+static bool
+ack_seen(const struct netdump_client *client, uint32_t seqno)
+{
+
+	seqno %= DELACK_SEQNOS;
+	return ((client->ack_seen[seqno / 64] & (1ULL << (seqno % 64))) != 0);
+}
+
+/*
+ * Arm the delayed ACK timer. It isn't stopped when the ACK is sent early, and
+ * then expires harmlessly or acknowledges the next packets a little early.
+ */
+static void
+delack_arm(struct netdump_client *client)
+{
+	struct kevent event;
+
+	if (client->ack_timer)
+		return;
+	EV_SET(&event, client->sock, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+	    NOTE_USECONDS, client->delack_usec, client);
+	if (kevent(client->worker->kq, &event, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EVFILT_TIMER)");
+		client->ack_unsent = 0;
+		send_ack(client, client->ack_cum);
+		return;
+	}
+	client->ack_timer = true;
+}
+
+/* Send the cumulative ACK held back when the delayed ACK timer expires. */
+static void
+delack_expire(struct netdump_client *client)
+{
+
+	client->ack_timer = false;
+	if (client->ack_unsent == 0)
+		return;
+	client->ack_unsent = 0;
+	client->ack_expired++;
+	send_ack(client, client->ack_cum);
+}
+
+/*
+ * Acknowledge a message. With delayed ACKs, the cumulative ACK for in-order
+ * messages that may be delayed is only sent every delack_pkts of them, or once
+ * the timer armed by the first one expires. Anything else is acknowledged at
+ * once, so that the sender learns about gaps quickly.
+ */
+static void
+client_ack(struct netdump_client *client, uint32_t seqno, bool delay)
+{
+	uint32_t d, i;
+
+	if ((client->ext_flags & NETDUMP_EXT_DELACK) == 0) {
+		send_ack(client, seqno);
+		return;
+	}
+
+	d = seqno - client->ack_cum;
+	if (d == 0 || d > DELACK_SEQNOS || ack_seen(client, seqno))
+		/* A retransmit, or too far ahead to be tracked. */
+		delay = false;
+	else {
+		i = seqno % DELACK_SEQNOS;
+		client->ack_seen[i / 64] |= 1ULL << (i % 64);
+		while (ack_seen(client, client->ack_cum + 1)) {
+			i = ++client->ack_cum % DELACK_SEQNOS;
+			client->ack_seen[i / 64] &= ~(1ULL << (i % 64));
+		}
+		if (client->ack_cum != seqno)
+			/* Out of order, or filling a gap. */
+			delay = false;
+	}
+	if (delay && ++client->ack_unsent < client->delack_pkts) {
+		delack_arm(client);
+		return;
+	}
+	client->ack_unsent = 0;
+	send_ack(client, client->ack_cum);
+}
+
+/*
+ * Send ACKs for the given seqnos, stopping if the socket buffer fills up.
+ * Returns the number of ACKs sent or given up on because of an error, and sets
+ * *blockedp if the remaining ones should be retried once the socket is
+ * writable.
+ */
+static int
+ack_xmit(struct netdump_client *client, const uint32_t *seqnos, int cnt,
+    bool *blockedp)
+{
+	struct netdump_ack_ext acks[CLIENT_BATCH];
+	struct iovec iovs[CLIENT_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[CLIENT_BATCH];
+	ssize_t n;
+#endif
+	struct netdump_sack sacks[NETDUMP_SACK_MAX];
+	uint32_t window;
+	size_t acklen;
+	int i, nsacks;
+
+	/*
+	 * The window and SACK ranges are computed once for the whole batch.
+	 * Clients that asked for neither get the original ACK, which is a
+	 * prefix of the extended one.
+	 */
+	acklen = sizeof(struct netdump_ack);
+	window = 0;
+	nsacks = 0;
+	if ((client->ext_flags & NETDUMP_EXT_WINDOW) != 0) {
+		acklen = offsetof(struct netdump_ack_ext, na_nsacks);
+		window = client_window(client);
+		client->ack_window = window;
+	}
+	if ((client->ext_flags & NETDUMP_EXT_SACK) != 0) {
+		nsacks = client_sacks(client, sacks);
+		acklen = offsetof(struct netdump_ack_ext, na_sacks) +
+		    nsacks * sizeof(sacks[0]);
+	}
+
+	*blockedp = false;
+	cnt = MIN(cnt, CLIENT_BATCH);
+	for (i = 0; i < cnt; i++) {
+		bzero(&acks[i], acklen);
+		acks[i].na_seqno = htonl(seqnos[i]);
+		acks[i].na_window = htonl(window);
+		acks[i].na_nsacks = htonl(nsacks);
+		memcpy(acks[i].na_sacks, sacks, nsacks * sizeof(sacks[0]));
+		iovs[i].iov_base = &acks[i];
+		iovs[i].iov_len = acklen;
+	}
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(msgs[0]) * cnt);
+	for (i = 0; i < cnt; i++) {
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < cnt; i += n) {
+		client->ack_syscalls++;
+		n = sendmmsg(client->sock, &msgs[i], cnt - i, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				*blockedp = true;
+				return (i);
+			}
+			LOGERR_PERROR("sendmmsg()");
+			return (cnt);
+		}
+		client->ack_pkts += n;
+	}
+#else
+	for (i = 0; i < cnt; i++) {
+		client->ack_syscalls++;
+		if (send(client->sock, iovs[i].iov_base, iovs[i].iov_len,
+		    0) == -1) {
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				*blockedp = true;
+				return (i);
+			}
+			LOGERR_PERROR("send()");
+			continue;
+		}
+		client->ack_pkts++;
+	}
+#endif
+	return (cnt);
+}
+
+/* Start or stop waiting for a client's socket to become writable. */
+static void
+ack_wait_writable(struct netdump_client *client, bool wait)
+{
+	struct kevent event;
+
+	if (wait == client->ack_wait)
+		return;
+	EV_SET(&event, client->sock, EVFILT_WRITE,
+	    wait ? EV_ADD | EV_ENABLE : EV_DISABLE, 0, 0, client);
+	if (kevent(client->worker->kq, &event, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EVFILT_WRITE)");
+		return;
+	}
+	client->ack_wait = wait;
+}
+
+/*
+ * Send ACKs queued on a client's full socket buffer, in order. This is called
+ * when the socket becomes writable, and before sending newer ACKs.
+ */
+static void
+send_acks_pending(struct netdump_client *client)
+{
+	bool blocked;
+	int n;
+
+	blocked = false;
+	while (client->nackpend > 0 && !blocked) {
+		n = ack_xmit(client, client->ackpend, client->nackpend,
+		    &blocked);
+		client->ack_retried += n;
+		client->nackpend -= n;
+		memmove(client->ackpend, client->ackpend + n,
+		    client->nackpend * sizeof(client->ackpend[0]));
+	}
+	ack_wait_writable(client, client->nackpend > 0);
+}
+
+/*
+ * Send the ACKs queued for a client. ACKs that don't fit in the socket buffer
+ * are kept, and sent once the socket becomes writable, rather than being left
+ * for the client to recover from by retransmitting.
+ */
+static void
+send_acks(struct netdump_client *client)
+{
+	bool blocked;
+	int i, n;
+
+	if (client->nacks == 0)
+		return;
+
+	if (client->nackpend > 0)
+		send_acks_pending(client);
+	n = 0;
+	if (client->nackpend == 0)
+		n = ack_xmit(client, client->ackq, client->nacks, &blocked);
+	for (i = n; i < client->nacks; i++) {
+		if (client->nackpend == ACK_PENDING) {
+			client->ack_dropped += client->nacks - i;
+			break;
+		}
+		client->ackpend[client->nackpend++] = client->ackq[i];
+		client->ack_queued++;
+	}
+	client->nacks = 0;
+	ack_wait_writable(client, client->nackpend > 0);
+}
+
+/*
+ * Send an ACK without going through a client's queues. The herald path uses
+ * this, since it may not own the client.
+ */
+static void
+send_ack_direct(int sd, uint32_t seqno)
+{
+	struct netdump_ack ack;
+
+	bzero(&ack, sizeof(ack));
+	ack.na_seqno = htonl(seqno);
+	if (send(sd, &ack, sizeof(ack), 0) == -1)
+		LOGERR_PERROR("send()");
+}
+
+/*
+ * Acknowledge a client's herald. Clients that requested protocol extensions
+ * are told which ones were accepted.
+ */
+static void
+send_herald_ack(struct netdump_client *client, uint32_t seqno)
+{
+	struct netdump_herald_ack ack;
+	int i;
+
+	if (!client->ext) {
+		send_ack_direct(client->sock, seqno);
+		return;
+	}
+
+	bzero(&ack, sizeof(ack));
+	ack.nha_seqno = htonl(seqno);
+	ack.nha_magic = htonl(NETDUMP_EXT_MAGIC);
+	ack.nha_flags = htonl(client->ext_flags);
+	ack.nha_datasize = htonl(client->datasize);
+	if ((client->ext_flags & NETDUMP_EXT_WINDOW) != 0)
+		/*
+		 * The client may not be ours to inspect yet, so advertise
+		 * what an idle client can absorb.
+		 */
+		ack.nha_window = htonl(MIN(client->rcvbufsz,
+		    (g_nwriters > 0 || client->aio) ?
+		    (int64_t)(g_vbcount + 1) * (int64_t)g_vbsize : INT_MAX));
+	ack.nha_ackpkts = htonl(client->delack_pkts);
+	ack.nha_ackusec = htonl(client->delack_usec);
+	if ((client->ext_flags & NETDUMP_EXT_STREAMS) != 0) {
+		/* Stripes match the buffers that streams fill. */
+		ack.nha_nstreams = htonl(client->nstreams);
+		ack.nha_stripe = htonl(g_vbsize);
+		for (i = 1; i < client->nstreams; i++)
+			ack.nha_ports[i] = client->stream_ports[i];
+	}
+	ack.nha_fecgroup = htonl(client->fec_group);
+	ack.nha_resumeoff = htobe64(client->resume_off);
+	if (send(client->sock, &ack, sizeof(ack), 0) == -1)
+		LOGERR_PERROR("send()");
+}
+
+/*
+ * Reserve space for the whole dump so that the core file is laid out in a few
+ * large extents rather than growing piecemeal as writes land. This is only an
+ * optimization: the outcome is recorded in the info file and otherwise
+ * ignored.
+ */
+static void
+vmcore_prealloc(struct netdump_client *client, uint64_t dumplen)
+{
+	struct statvfs sv;
+	uint64_t avail;
+	int error;
+
+	if (client->preallocated || dumplen == 0 || dumplen > OFF_MAX)
+		return;
+	client->preallocated = true;
+
+	if (fstatvfs(client->corefd, &sv) != 0) {
+		error = errno;
+		LOGERR("fstatvfs(%s): %s\n", client->corefilename,
+		    strerror(error));
+		client_pinfo(client, "  Preallocation: failed (%s)\n",
+		    strerror(error));
+		return;
+	}
+	avail = (uint64_t)sv.f_bavail * sv.f_frsize;
+	if (avail < dumplen) {
+		LOGWARN("Not enough space to preallocate %s: %ju MB free\n",
+		    client->corefilename, (uintmax_t)(avail >> 20));
+		client_pinfo(client,
+		    "  Preallocation: skipped (%ju MB free)\n",
+		    (uintmax_t)(avail >> 20));
+		return;
+	}
+
+	error = posix_fallocate(client->corefd, 0, (off_t)dumplen);
+	if (error != 0) {
+		client_pinfo(client, "  Preallocation: failed (%s)\n",
+		    strerror(error));
+		return;
+	}
+	client_pinfo(client, "  Preallocation: %ju MB\n",
+	    (uintmax_t)(dumplen >> 20));
+}
+
+static int
+handle_kdh(struct netdump_client *client, struct netdump_pkt *pkt)
+{
+#if KERNELDUMPVERSION >= 3
+	static const char *const compalgos[] = {
+	    [KERNELDUMP_COMP_NONE] = "none",
+	    [KERNELDUMP_COMP_GZIP] = "gzip",
+#ifdef KERNELDUMP_COMP_ZSTD
+	    [KERNELDUMP_COMP_ZSTD] = "zstd",
+#endif
+	    NULL,
+	};
+	static const char *const suffixes[] = {
+	    [KERNELDUMP_COMP_GZIP] = ".gz",
+#ifdef KERNELDUMP_COMP_ZSTD
+	    [KERNELDUMP_COMP_ZSTD] = ".zst",
+#endif
+	};
+	const char *compalgo;
+#endif /* KERNELDUMPVERSION >= 3 */
+#if KERNELDUMPVERSION >= 2
+	char newpath[MAXPATHLEN];
+	char *p;
+	int limit;
+#endif
+	struct kerneldumpheader *kdh;
+	char timebuf[26];
+	uint64_t dumplen;
+	time_t t;
+	int parity_check;
+
+	client->any_data_rcvd = true;
+
+	LOGINFO("(KDH from %s [%s])\n", client->hostname, client_ntoa(client));
+	client_ack(client, pkt->hdr.mh_seqno, false);
+
+	if (pkt->hdr.mh_len < sizeof(struct kerneldumpheader)) {
+		LOGERR("Bad KDH from %s [%s]: packet too small\n",
+		    client->hostname, client_ntoa(client));
+		client_pinfo(client, "Bad KDH: packet too small\n");
+		return (0);
+	}
+
+	kdh = (struct kerneldumpheader *)(void *)pkt->data;
+
+	parity_check = kerneldump_parity(kdh);
+
+	/* Make sure all the strings are null-terminated. */
+	kdh->architecture[sizeof(kdh->architecture) - 1] = '\0';
+	kdh->hostname[sizeof(kdh->hostname) - 1] = '\0';
+	kdh->versionstring[sizeof(kdh->versionstring) - 1] = '\0';
+	kdh->panicstring[sizeof(kdh->panicstring) - 1] = '\0';
+
+	client_pinfo(client, "  Architecture: %s\n", kdh->architecture);
+	client_pinfo(client, "  Architecture version: %d\n",
+	    dtoh32(kdh->architectureversion));
+	dumplen = dtoh64(kdh->dumplength);
+	client->dumplen = dumplen;
+	client_pinfo(client, "  Dump length: %lldB (%lld MB)\n",
+	    (long long)dumplen, (long long)(dumplen >> 20));
+	client_pinfo(client, "  Blocksize: %d\n", dtoh32(kdh->blocksize));
+	t = dtoh64(kdh->dumptime);
+#if KERNELDUMPVERSION >= 3
+	if (kdh->version >= 3) {
+		if (kdh->compression < nitems(compalgos))
+			compalgo = compalgos[kdh->compression];
+		else
+			compalgo = "???";
+		client_pinfo(client, "  Compression: %s\n", compalgo);
+	}
+#endif
+	client_pinfo(client, "  Dumptime: %s", ctime_r(&t, timebuf));
+	client_pinfo(client, "  Hostname: %s\n", kdh->hostname);
+	client_pinfo(client, "  Versionstring: %s", kdh->versionstring);
+	client_pinfo(client, "  Panicstring: %s\n", kdh->panicstring);
+	client_pinfo(client, "  Header parity check: %s\n",
+	    parity_check ? "Fail" : "Pass");
+	if (parity_check == 0)
+		vmcore_prealloc(client, dumplen);
+	fflush(client->infofile);
+
+#if KERNELDUMPVERSION >= 2
+	if (kdh->version >= 2 && kdh->dumpkeysize > 0) {
+		(void)strlcpy(newpath, client->corefilename, sizeof(newpath));
+		p = strrchr(newpath, '/');
+		if (p == NULL ||
+		    strncmp(p + 1, "vmcore.", 7) != 0)
+			LOGWARN("Corrupted core file path '%s'\n",
+			    client->corefilename);
+		else {
+			p++;
+			limit = sizeof(newpath) - (p - &newpath[0]);
+			if (snprintf(p, limit, "vmcore_encrypted.%s.%d",
+			    client->hostname, client->index) < limit) {
+				renameat(g_dumpdir_fd, client->corefilename,
+				    g_dumpdir_fd, newpath);
+				(void)strlcpy(client->corefilename, newpath,
+				    sizeof(client->corefilename));
+			} else
+				LOGWARN(
+			    "Couldn't append encryption suffix to '%s'\n",
+				    client->corefilename);
+		}
+	}
+#endif
+#if KERNELDUMPVERSION >= 3
+	/*
+	 * Rename the dump file so that it has the correct suffix, and truncate
+	 * it to the correct size. The kernel dump code always writes in
+	 * multiples of the block size, so the resulting file size will be
+	 * rounded up to the next multiple. The trailing bytes confuse
+	 * decompressors, so chop them off now. This is a bit of a hack, but so
+	 * it goes.
+	 */
+	if (kdh->version >= 3 && kdh->compression < nitems(compalgos) &&
+	    kdh->compression != KERNELDUMP_COMP_NONE) {
+		(void)strlcpy(newpath, client->corefilename, sizeof(newpath));
+		if (strlcat(newpath, suffixes[kdh->compression],
+		    sizeof(newpath)) < sizeof(newpath)) {
+			renameat(g_dumpdir_fd, client->corefilename,
+			    g_dumpdir_fd, newpath);
+			(void)strlcpy(client->corefilename, newpath,
+			    sizeof(client->corefilename));
+		} else
+			LOGWARN("Couldn't append compression suffix to '%s'\n",
+			    client->corefilename);
+
+		if (vmcore_truncate(client, dumplen) != 0)
+			return (1);
+	}
+#endif
+	return (0);
+}
+
+static void
+handle_ekcd_key(struct netdump_client *client, struct netdump_pkt *pkt)
+{
+	char *data;
+	ssize_t n;
+	uint32_t bytes, offset;
+	int fd;
+
+	if (client->keyfilefd == -1) {
+		char keyfile[MAXPATHLEN];
+		size_t len;
+
+		len = snprintf(keyfile, sizeof(keyfile), "%s/key.%s.%d",
+		    client->path, client->hostname, client->index);
+		if (len >= sizeof(keyfile)) {
+			LOGERR(
+			    "Truncated key file path for client %s [%s]: %s\n",
+			    client->hostname, client_ntoa(client), keyfile);
+			return;
+		}
+
+		fd = openat(g_dumpdir_fd, keyfile,
+		    O_WRONLY | O_CREAT | O_CLOEXEC, 0400);
+		if (fd < 0) {
+			LOGERR_PERROR("openat()");
+			return;
+		}
+		client->keyfilefd = fd;
+
+		LOGINFO("(EKCD key from %s [%s])\n",
+		    client->hostname, client_ntoa(client));
+	} else
+		fd = client->keyfilefd;
+
+	bytes = pkt->hdr.mh_len;
+	data = pkt->data;
+	offset = pkt->hdr.mh_offset;
+	do {
+		n = pwrite(fd, data, bytes, offset);
+		if (n < 0) {
+			LOGERR_PERROR("write()");
+			return;
+		}
+		bytes -= n;
+		data += n;
+		offset += n;
+	} while (bytes > 0);
+
+	client_ack(client, pkt->hdr.mh_seqno, false);
+}
+
+/*
+ * Find the index of the first extent ending at or after the given offset, or
+ * set->n if there is none.
+ */
+static int
+extent_find(const struct extent_set *set, off_t off)
+{
+	int hi, lo, mid;
+
+	lo = 0;
+	hi = set->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (set->ext[mid].end < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* Return true if the range [start, end) was entirely received already. */
+static bool
+extent_contains(const struct extent_set *set, off_t start, off_t end)
+{
+	int i;
+
+	if (set->n == 0)
+		return (false);
+	/* The common case: the range extends the last extent. */
+	if (start >= set->ext[set->n - 1].end)
+		return (false);
+	i = extent_find(set, end);
+	return (i < set->n && set->ext[i].start <= start);
+}
+
+/* Record the range [start, end) as received, merging it with neighbours. */
+static void
+extent_add(struct extent_set *set, off_t start, off_t end)
+{
+	struct extent *ext;
+	int i, j;
+
+	if (set->overflow || start >= end)
+		return;
+
+	if (set->n > 0 && start >= set->ext[set->n - 1].start) {
+		ext = &set->ext[set->n - 1];
+		if (start <= ext->end) {
+			ext->end = MAX(ext->end, end);
+			return;
+		}
+		i = set->n;
+	} else
+		i = extent_find(set, start);
+
+	/* Merge with every extent overlapping or adjacent to the range. */
+	for (j = i; j < set->n && set->ext[j].start <= end; j++) {
+		start = MIN(start, set->ext[j].start);
+		end = MAX(end, set->ext[j].end);
+	}
+	if (j > i) {
+		set->ext[i].start = start;
+		set->ext[i].end = end;
+		memmove(&set->ext[i + 1], &set->ext[j],
+		    (set->n - j) * sizeof(*set->ext));
+		set->n -= j - i - 1;
+		return;
+	}
+
+	if (set->n == set->cap) {
+		if (set->cap == EXTENTS_MAX) {
+			set->overflow = true;
+			return;
+		}
+		ext = reallocarray(set->ext, set->cap == 0 ? 16 : set->cap * 2,
+		    sizeof(*set->ext));
+		if (ext == NULL) {
+			LOGERR_PERROR("reallocarray()");
+			set->overflow = true;
+			return;
+		}
+		set->ext = ext;
+		set->cap = set->cap == 0 ? 16 : set->cap * 2;
+	}
+	memmove(&set->ext[i + 1], &set->ext[i],
+	    (set->n - i) * sizeof(*set->ext));
+	set->ext[i].start = start;
+	set->ext[i].end = end;
+	set->n++;
+}
+
+/*
+ * Fill in the SACK ranges sent to a client: the lowest received extents, which
+ * bound the oldest holes. Returns the number of ranges, which is 0 once
+ * tracking has stopped, since the extents no longer tell holes apart.
+ */
+static int
+client_sacks(const struct netdump_client *client, struct netdump_sack *sacks)
+{
+	const struct extent_set *set;
+	int i, n;
+
+	set = &client->rcvd;
+	if (set->overflow)
+		return (0);
+	n = MIN(set->n, NETDUMP_SACK_MAX);
+	for (i = 0; i < n; i++) {
+		sacks[i].ns_start = htobe64(set->ext[i].start);
+		sacks[i].ns_end = htobe64(set->ext[i].end);
+	}
+	return (n);
+}
+
+/*
+ * Report in the info file whether every byte of the dump was received, listing
+ * the holes otherwise.
+ */
+static void
+client_report_extents(struct netdump_client *client)
+{
+	struct extent_set *set;
+	uint64_t missing;
+	off_t end, pos;
+	int holes, i;
+
+	set = &client->rcvd;
+	if (client->vmcore_dup > 0)
+		client_pinfo(client, "  Duplicate bytes: %ju (%ju MB)\n",
+		    (uintmax_t)client->vmcore_dup,
+		    (uintmax_t)(client->vmcore_dup >> 20));
+	if (set->overflow) {
+		client_pinfo(client, "  Data: unknown (too many extents)\n");
+		return;
+	}
+
+	end = client->dumplen != 0 ? (off_t)client->dumplen :
+	    client->extent_end;
+	missing = 0;
+	holes = 0;
+	pos = 0;
+	for (i = 0; i <= set->n && pos < end; i++) {
+		if (i < set->n && set->ext[i].start <= pos) {
+			pos = MAX(pos, set->ext[i].end);
+			continue;
+		}
+		if (i == set->n || set->ext[i].start > end) {
+			/* A hole runs to the end of the dump. */
+			missing += end - pos;
+			if (holes++ < HOLES_MAX)
+				client_pinfo(client,
+				    "  Hole: %08jx-%08jx\n", (uintmax_t)pos,
+				    (uintmax_t)end);
+			break;
+		}
+		missing += set->ext[i].start - pos;
+		if (holes++ < HOLES_MAX)
+			client_pinfo(client, "  Hole: %08jx-%08jx\n",
+			    (uintmax_t)pos, (uintmax_t)set->ext[i].start);
+		pos = set->ext[i].end;
+	}
+	if (holes == 0)
+		client_pinfo(client, "  Data: complete\n");
+	else
+		client_pinfo(client,
+		    "  Data: incomplete, %d holes, %ju bytes missing\n",
+		    holes, (uintmax_t)missing);
+}
+
+/*
+ * The state of a resumable dump is saved next to its core file, in a text file
+ * holding a line with the dump's index, its length and the end of the data
+ * received, followed by a line for each extent received.
+ */
+static int
+resume_filename(const char *hostname, uint64_t token, const char *dir,
+    char *buf, size_t size)
+{
+	size_t len;
+
+	len = snprintf(buf, size, "%s/resume.%s.%016jx", dir, hostname,
+	    (uintmax_t)token);
+	if (len >= size) {
+		LOGERR("Truncated resume file path: '%s'\n", buf);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Reopen the files of a dump whose state was saved, and restore the extents
+ * received. Returns 0 on success, or -1 if the dump has to start over.
+ */
+static int
+resume_open(struct netdump_client *client, const char *dir)
+{
+	char resumepath[MAXPATHLEN];
+	FILE *fp;
+	uintmax_t dumplen, end, start;
+	size_t len;
+	int fd, index;
+
+	if (resume_filename(client->hostname, client->token, dir,
+	    resumepath, sizeof(resumepath)) != 0)
+		return (-1);
+	fd = openat(g_dumpdir_fd, resumepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			LOGERR("openat(%s): %s\n", resumepath, strerror(errno));
+		return (-1);
+	}
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		LOGERR_PERROR("fdopen()");
+		(void)close(fd);
+		return (-1);
+	}
+	if (fscanf(fp, "%d %ju %ju\n", &index, &dumplen, &end) != 3 ||
+	    index < 0 || index >= MAX_DUMPS) {
+		LOGERR("Bad resume file '%s'\n", resumepath);
+		goto error_out;
+	}
+
+	len = snprintf(client->infofilename, sizeof(client->infofilename),
+	    "%s/info.%s.%d", dir, client->hostname, index);
+	if (len >= sizeof(client->infofilename)) {
+		LOGERR("Truncated info file path: '%s'\n",
+		    client->infofilename);
+		goto error_out;
+	}
+	len = snprintf(client->corefilename, sizeof(client->corefilename),
+	    "%s/vmcore.%s.%d", dir, client->hostname, index);
+	if (len >= sizeof(client->corefilename)) {
+		LOGERR("Truncated core file path: '%s'\n",
+		    client->corefilename);
+		goto error_out;
+	}
+	fd = openat(g_dumpdir_fd, client->infofilename,
+	    O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("openat(%s): %s\n", client->infofilename,
+		    strerror(errno));
+		goto error_out;
+	}
+	client->infofile = fdopen(fd, "a");
+	if (client->infofile == NULL) {
+		LOGERR_PERROR("fdopen()");
+		(void)close(fd);
+		goto error_out;
+	}
+	fd = openat(g_dumpdir_fd, client->corefilename, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("openat(%s): %s\n", client->corefilename,
+		    strerror(errno));
+		(void)fclose(client->infofile);
+		client->infofile = NULL;
+		goto error_out;
+	}
+	client->corefd = fd;
+	client->index = index;
+	client->dumplen = dumplen;
+	client->extent_end = end;
+	while (fscanf(fp, "%jx %jx\n", &start, &end) == 2)
+		extent_add(&client->rcvd, start, end);
+	if (client->rcvd.n > 0 && client->rcvd.ext[0].start == 0)
+		client->resume_off = client->rcvd.ext[0].end;
+	(void)fclose(fp);
+	return (0);
+
+error_out:
+	(void)fclose(fp);
+	return (-1);
+}
+
+/*
+ * Save the state of a resumable dump that is going away. Only data known to be
+ * in the core file is recorded. Buffered data is written out first, and
+ * asynchronous writes are waited for and checked, but buffers still in a
+ * writer's ring or waiting for it are left out, along with everything past
+ * them. Returns 1 if the client was freed as a result of an error, 0 otherwise.
+ */
+static int
+resume_save(struct netdump_client *client)
+{
+	char resumepath[MAXPATHLEN], tmppath[MAXPATHLEN];
+	struct extent_set *set;
+	struct vmcore_buf *vb;
+	FILE *fp;
+	off_t cutoff;
+	size_t len;
+	uint64_t head, tail;
+	int fd, i;
+
+	if (vmcore_flush(client) != 0 ||
+	    vmcore_reorder_write(client, OFF_MAX) != 0)
+		return (1);
+	cutoff = OFF_MAX;
+	STAILQ_FOREACH(vb, &client->vbpend, link)
+		cutoff = MIN(cutoff, vb->off);
+	while ((vb = STAILQ_FIRST(&client->aioq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&client->aioq, link);
+		client->aio_inflight--;
+		if (vmcore_aio_wait(vb) != (ssize_t)vb->aiocb.aio_nbytes)
+			cutoff = MIN(cutoff, vb->off);
+		vmcore_buf_free(vb);
+	}
+	if (client->ring != NULL) {
+		if (atomic_load(&client->werror)) {
+			LOGWARN(
+"Can't save the state of the dump from %s [%s]: write error\n",
+			    client->hostname, client_ntoa(client));
+			return (0);
+		}
+		/* Slots the writer frees meanwhile just count as unwritten. */
+		head = atomic_load(&client->ring_head);
+		for (tail = atomic_load(&client->ring_tail); tail != head;
+		    tail++)
+			cutoff = MIN(cutoff, client->ring_off[tail % g_vbcount]);
+	}
+
+	set = &client->rcvd;
+	if (set->overflow) {
+		LOGWARN("Can't save the state of the dump from %s [%s]\n",
+		    client->hostname, client_ntoa(client));
+		return (0);
+	}
+	if (resume_filename(client->hostname, client->token, client->path,
+	    resumepath, sizeof(resumepath)) != 0)
+		return (0);
+	len = snprintf(tmppath, sizeof(tmppath), "%s.tmp", resumepath);
+	if (len >= sizeof(tmppath)) {
+		LOGERR("Truncated resume file path: '%s'\n", tmppath);
+		return (0);
+	}
+	fd = openat(g_dumpdir_fd, tmppath,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGERR("openat(%s): %s\n", tmppath, strerror(errno));
+		return (0);
+	}
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		LOGERR_PERROR("fdopen()");
+		(void)close(fd);
+		(void)unlinkat(g_dumpdir_fd, tmppath, 0);
+		return (0);
+	}
+
+	(void)fprintf(fp, "%d %ju %ju\n", client->index,
+	    (uintmax_t)client->dumplen,
+	    (uintmax_t)MIN(client->extent_end, cutoff));
+	for (i = 0; i < set->n && set->ext[i].start < cutoff; i++)
+		(void)fprintf(fp, "%jx %jx\n", (uintmax_t)set->ext[i].start,
+		    (uintmax_t)MIN(set->ext[i].end, cutoff));
+	if (fclose(fp) != 0) {
+		LOGERR("Failed to save %s: %s\n", tmppath, strerror(errno));
+		(void)unlinkat(g_dumpdir_fd, tmppath, 0);
+		return (0);
+	}
+	if (renameat(g_dumpdir_fd, tmppath, g_dumpdir_fd, resumepath) != 0) {
+		LOGERR_PERROR("renameat()");
+		(void)unlinkat(g_dumpdir_fd, tmppath, 0);
+		return (0);
+	}
+	client_pinfo(client, "Dump state saved for resumption\n");
+	return (0);
+}
+
+/* Forget the saved state of a resumable dump once it has completed. */
+static void
+resume_remove(struct netdump_client *client)
+{
+	char resumepath[MAXPATHLEN];
+
+	if (resume_filename(client->hostname, client->token, client->path,
+	    resumepath, sizeof(resumepath)) != 0)
+		return;
+	if (unlinkat(g_dumpdir_fd, resumepath, 0) != 0 && errno != ENOENT)
+		LOGERR_PERROR("unlinkat()");
+}
+
+/*
+ * Append vmcore data to the buffer being filled. The buffer is flushed first
+ * if it's full, or if the data isn't contiguous with respect to any
+ * already-buffered data. Returns 1 if the client was freed as a result of an
+ * error, 0 otherwise.
+ */
+static int
+vmcore_append(struct netdump_client *client, off_t off, const uint8_t *data,
+    uint32_t len)
+{
+	uint8_t *dst;
+
+	/*
+	 * Held segments that the data skips past would never become contiguous
+	 * with it, so they are written out now.
+	 */
+	if (off > client->vmcore_next && client->reorder != NULL &&
+	    client->reorder->nheld > 0 &&
+	    vmcore_reorder_write(client, off) != 0)
+		return (1);
+
+	if (client->vb->len + client->datasize > (ssize_t)g_vbsize ||
+	    (client->vb->len > 0 &&
+	     client->vb->off + client->vb->len != off))
+		if (vmcore_flush(client) != 0)
+			return (1);
+
+	/*
+	 * Buffer vmcore contents. This greatly improves throughput over
+	 * simply writing each packet's contents directly. In the common case
+	 * the payload was received in place; otherwise it was received into
+	 * the overflow buffer or past a short or non-contiguous packet, or was
+	 * held for reordering, and must be moved.
+	 */
+	dst = client->vb->data + client->vb->len;
+	if (data != dst) {
+		memmove(dst, data, len);
+		client->vmcore_copied += len;
+	}
+	if (client->vb->len == 0)
+		client->vb->off = off;
+	client->vb->len += len;
+	client->vmcore_next = off + len;
+	client->extent_end = MAX(client->extent_end, client->vmcore_next);
+	return (0);
+}
+
+/* Find the held segment starting at the given offset. */
+static struct reorder_slot *
+vmcore_reorder_find(struct vmcore_reorder *ro, off_t off)
+{
+	int i;
+
+	for (i = 0; i < REORDER_SLOTS; i++)
+		if (ro->slots[i].len != 0 && ro->slots[i].off == off)
+			return (&ro->slots[i]);
+	return (NULL);
+}
+
+/*
+ * Hold a vmcore segment that is ahead of the data appended so far, if it falls
+ * within the reordering window. Returns true if the segment was held.
+ */
+static bool
+vmcore_reorder_hold(struct netdump_client *client, struct netdump_pkt *pkt)
+{
+	struct vmcore_reorder *ro;
+	struct reorder_slot *slot;
+	off_t off;
+	int i;
+
+	off = pkt->hdr.mh_offset;
+	if (client->vmcore_next == 0 || off <= client->vmcore_next ||
+	    off - client->vmcore_next >=
+	    (off_t)REORDER_SLOTS * client->datasize)
+		return (false);
+
+	if (client->reorder == NULL) {
+		client->reorder = calloc(1, sizeof(*client->reorder) +
+		    (size_t)REORDER_SLOTS * client->datasize);
+		if (client->reorder == NULL) {
+			LOGERR_PERROR("calloc()");
+			return (false);
+		}
+		for (i = 0; i < REORDER_SLOTS; i++)
+			client->reorder->slots[i].data = client->reorder->data +
+			    (size_t)i * client->datasize;
+	}
+	ro = client->reorder;
+	slot = vmcore_reorder_find(ro, off);
+	if (slot == NULL) {
+		for (i = 0; i < REORDER_SLOTS && ro->slots[i].len != 0; i++)
+			;
+		if (i == REORDER_SLOTS)
+			return (false);
+		slot = &ro->slots[i];
+		ro->nheld++;
+	}
+	slot->off = off;
+	slot->len = pkt->hdr.mh_len;
+	memcpy(slot->data, pkt->data, pkt->hdr.mh_len);
+	client->vmcore_copied += pkt->hdr.mh_len;
+	client->vmcore_held++;
+	client->extent_end = MAX(client->extent_end, off + slot->len);
+	return (true);
+}
+
+/*
+ * Append held segments that have become contiguous with the buffered data.
+ * This is called once all packets in a batch have been processed, since
+ * appending more than one payload per packet could otherwise overwrite
+ * payloads of the batch that were received into the buffer but not yet
+ * processed. Returns 1 if the client was freed as a result of an error, 0
+ * otherwise.
+ */
+static int
+vmcore_reorder_drain(struct netdump_client *client)
+{
+	struct vmcore_reorder *ro;
+	struct reorder_slot *slot;
+
+	ro = client->reorder;
+	if (ro == NULL)
+		return (0);
+	while (ro->nheld > 0 &&
+	    (slot = vmcore_reorder_find(ro, client->vmcore_next)) != NULL) {
+		if (vmcore_append(client, slot->off, slot->data,
+		    slot->len) != 0)
+			return (1);
+		slot->len = 0;
+		ro->nheld--;
+	}
+	return (0);
+}
+
+static int
+reorder_slot_cmp(const void *a, const void *b)
+{
+	const struct reorder_slot *sa, *sb;
+
+	sa = *(const struct reorder_slot * const *)a;
+	sb = *(const struct reorder_slot * const *)b;
+	return (sa->off < sb->off ? -1 : sa->off > sb->off);
+}
+
+/*
+ * Write out the held segments that start below the given offset, merging
+ * contiguous runs into a single pwritev(2). This is used when the data
+ * preceding the segments is not going to be appended: the dump is finishing,
+ * or the data appended skipped past them. Returns 1 if the client was freed
+ * as a result of an error, 0 otherwise.
+ */
+static int
+vmcore_reorder_write(struct netdump_client *client, off_t below)
+{
+	struct reorder_slot *held[REORDER_SLOTS];
+	struct iovec iov[REORDER_SLOTS];
+	struct vmcore_reorder *ro;
+	ssize_t len, n;
+	off_t off;
+	int error, i, j, nheld;
+
+	ro = client->reorder;
+	if (ro == NULL || ro->nheld == 0)
+		return (0);
+
+	nheld = 0;
+	for (i = 0; i < REORDER_SLOTS; i++)
+		if (ro->slots[i].len != 0 && ro->slots[i].off < below)
+			held[nheld++] = &ro->slots[i];
+	if (nheld == 0)
+		return (0);
+	qsort(held, nheld, sizeof(held[0]), reorder_slot_cmp);
+
+	for (i = 0; i < nheld; i = j) {
+		off = held[i]->off;
+		len = 0;
+		for (j = i; j < nheld && held[j]->off == off + len; j++) {
+			iov[j - i].iov_base = held[j]->data;
+			iov[j - i].iov_len = held[j]->len;
+			len += held[j]->len;
+		}
+		n = pwritev(client->corefd, iov, j - i, off);
+		if (n != len) {
+			error = n < 0 ? errno : EIO;
+			LOGERR("pwritev (for client %s [%s]): %s\n",
+			    client->hostname, client_ntoa(client),
+			    strerror(error));
+			vmcore_error(client, error, off);
+			return (1);
+		}
+	}
+	for (i = 0; i < nheld; i++)
+		held[i]->len = 0;
+	ro->nheld -= nheld;
+	return (0);
+}
+
+static int
+handle_vmcore(struct netdump_client *client, struct netdump_pkt *pkt)
+{
+
+	client->any_data_rcvd = true;
+	if (pkt->hdr.mh_seqno % (16 * 1024 * 1024 / 1456) == 0) {
 		/* Approximately every 16MB with MTU of 1500 */
 		LOGINFO(".");
 	}
 
+	client->vmcore_rcvd += pkt->hdr.mh_len;
+
 	/*
-	 * Flush the vmcore buffer if it's full, or if the received segment
-	 * isn't contiguous with respect to any already-buffered data.
+	 * The kernel retransmits segments whose ACK was lost. Don't rewrite
+	 * them.
 	 */
-	if (client->vmcorebufoff + NETDUMP_DATASIZE > VMCORE_BUFSZ ||
-	    (client->vmcorebufoff > 0 &&
-	     client->vmcoreoff + client->vmcorebufoff !=
-	     (off_t)pkt->hdr.mh_offset))
-		if (vmcore_flush(client) != 0)
-			return;
+	if (extent_contains(&client->rcvd, pkt->hdr.mh_offset,
+	    (off_t)pkt->hdr.mh_offset + pkt->hdr.mh_len)) {
+		client->vmcore_dup += pkt->hdr.mh_len;
+		client_ack(client, pkt->hdr.mh_seqno, false);
+		return (0);
+	}
+	extent_add(&client->rcvd, pkt->hdr.mh_offset,
+	    (off_t)pkt->hdr.mh_offset + pkt->hdr.mh_len);
 
 	/*
-	 * Buffer vmcore contents. This greatly improves throughput over
-	 * simply writing each packet's contents directly.
+	 * Hold on to a segment that arrived ahead of the data preceding it, so
+	 * that a reordered or lost packet doesn't split the buffer into small
+	 * writes.
 	 */
-	memcpy(client->vmcorebuf + client->vmcorebufoff, pkt->data,
-	    pkt->hdr.mh_len);
-	if (client->vmcorebufoff == 0)
-		client->vmcoreoff = pkt->hdr.mh_offset;
-	client->vmcorebufoff += pkt->hdr.mh_len;
+	if (vmcore_reorder_hold(client, pkt)) {
+		client_ack(client, pkt->hdr.mh_seqno, true);
+		return (0);
+	}
+
+	if (vmcore_append(client, pkt->hdr.mh_offset, pkt->data,
+	    pkt->hdr.mh_len) != 0)
+		return (1);
 
-	send_ack(client, pkt->hdr.mh_seqno);
+	client_ack(client, pkt->hdr.mh_seqno, true);
+	return (0);
 }
 
-static void
+/*
+ * Decompress an LZ4-compressed payload and handle it as a VMCORE message. A
+ * corrupt payload is dropped unacknowledged, so that it is sent again.
+ */
+static int
+handle_vmcore_lz4(struct netdump_client *client, struct netdump_pkt *pkt)
+{
+	struct netdump_pkt raw;
+	ssize_t len;
+
+	len = netdump_lz4_decompress(pkt->data, pkt->hdr.mh_len,
+	    client->worker->lz4buf, client->datasize);
+	if (len <= 0) {
+		LOGERR("Ignoring corrupt compressed packet from %s\n",
+		    client_ntoa(client));
+		return (0);
+	}
+	client->lz4_pkts++;
+	client->lz4_bytes += pkt->hdr.mh_len;
+	client->lz4_rawbytes += len;
+
+	raw.hdr = pkt->hdr;
+	raw.hdr.mh_type = NETDUMP_VMCORE;
+	raw.hdr.mh_len = (uint32_t)len;
+	raw.data = client->worker->lz4buf;
+	return (handle_vmcore(client, &raw));
+}
+
+static int
 handle_finish(struct netdump_client *client, struct netdump_pkt *pkt)
 {
-	char symlinkpath[MAXPATHLEN], *symlinktarget;
+	int i;
+
+	/* A retransmit; we ACK once the dump is on stable storage. */
+	if (client->finishing)
+		return (0);
+	client->finishing = true;
+	client->finish_seqno = pkt->hdr.mh_seqno;
+
+	/*
+	 * The data received on other streams is written out first. Each
+	 * stream's event loop drains it and the last one reports back.
+	 */
+	if (client->nstreams > 1 && !client->streams_merged) {
+		atomic_store(&client->streams_busy, client->nstreams - 1);
+		for (i = 1; i < client->nstreams; i++)
+			client_request(client->streams[i], CLIENT_REQ_DRAIN);
+		return (0);
+	}
+	return (vmcore_finish(client));
+}
+
+/*
+ * Fold the bookkeeping of a dump's drained streams into the dump's, so that the
+ * core file is sized and checked for completeness as a whole.
+ */
+static void
+client_streams_merge(struct netdump_client *client)
+{
+	struct netdump_client *stream;
+	int i, j;
+
+	for (i = 1; i < client->nstreams; i++) {
+		stream = client->streams[i];
+		if (stream->rcvd.overflow)
+			client->rcvd.overflow = true;
+		for (j = 0; j < stream->rcvd.n; j++)
+			extent_add(&client->rcvd, stream->rcvd.ext[j].start,
+			    stream->rcvd.ext[j].end);
+		client->extent_end = MAX(client->extent_end,
+		    stream->extent_end);
+		client->zero_skipped += stream->zero_skipped;
+		client->vmcore_dup += stream->vmcore_dup;
+		client->fec_parity += stream->fec_parity;
+		client->fec_recovered += stream->fec_recovered;
+		client->lz4_pkts += stream->lz4_pkts;
+		client->lz4_bytes += stream->lz4_bytes;
+		client->lz4_rawbytes += stream->lz4_rawbytes;
+	}
+	client->streams_merged = true;
+}
+
+/*
+ * Write out a client's buffered vmcore data and sync the core file, completing
+ * the dump or, for a stream, reporting to its parent once that is done. Streams
+ * sync the file too, which leaves little for the parent's own sync to do.
+ * Returns 1 if the client was freed, 0 otherwise.
+ */
+static int
+vmcore_finish(struct netdump_client *client)
+{
 
 	/* Make sure we commit any buffered vmcore data. */
-	if (vmcore_flush(client) != 0)
-		return;
+	if (vmcore_flush(client) != 0 ||
+	    vmcore_reorder_write(client, OFF_MAX) != 0)
+		return (1);
+
+	/*
+	 * With writer threads or asynchronous I/O, the core file is synced once
+	 * everything queued before the request has been written, and the dump
+	 * is completed then.
+	 */
+	if (client->writer != NULL || client->aio) {
+		client->wctl_pending |= WCTL_SYNC;
+		return (0);
+	}
+	vmcore_extend(client);
 	if (fsync(client->corefd) != 0)
 		/* Not fatal. */
 		LOGERR_PERROR("fsync()");
+	return (client_finish(client));
+}
+
+/*
+ * Complete a dump whose data is on stable storage. Returns 1 if the client was
+ * freed, 0 otherwise, in which case a retransmitted FINISHED message will
+ * retry.
+ */
+static int
+client_finish(struct netdump_client *client)
+{
+	char symlinkpath[MAXPATHLEN], *symlinktarget;
+
+	client->finishing = false;
+	if (client->parent != NULL) {
+		if (atomic_fetch_sub(&client->parent->streams_busy, 1) == 1)
+			client_request(client->parent, CLIENT_REQ_STREAMS);
+		return (0);
+	}
 
 	/* Create symlinks to the new vmcore and info files. */
 	snprintf(symlinkpath, sizeof(symlinkpath), "%s/vmcore.%s.last",
 	    client->path, client->hostname);
 	if (unlinkat(g_dumpdir_fd, symlinkpath, 0) != 0 && errno != ENOENT) {
 		LOGERR_PERROR("unlinkat()");
-		return;
+		return (0);
 	}
 	symlinktarget = strdup(client->corefilename);
 	if (symlinkat(basename(symlinktarget), g_dumpdir_fd,
 	    symlinkpath) != 0) {
 		LOGERR_PERROR("symlink()");
 		free(symlinktarget);
-		return;
+		return (0);
 	}
 	free(symlinktarget);
 
@@ -814,137 +3483,1075 @@ handle_finish(struct netdump_client *client, struct netdump_pkt *pkt)
 	    client->path, client->hostname);
 	if (unlinkat(g_dumpdir_fd, symlinkpath, 0) != 0 && errno != ENOENT) {
 		LOGERR_PERROR("unlinkat()");
+		return (0);
+	}
+	symlinktarget = strdup(client->infofilename);
+	if (symlinkat(basename(symlinktarget), g_dumpdir_fd,
+	    symlinkpath) != 0) {
+		LOGERR_PERROR("symlink()");
+		free(symlinktarget);
+		return (0);
+	}
+	free(symlinktarget);
+
+	LOGINFO("Completed dump from client %s [%s]\n", client->hostname,
+	    client_ntoa(client));
+	if (client->token != 0)
+		resume_remove(client);
+	client_report_extents(client);
+	if (client->zero_skipped > 0)
+		client_pinfo(client, "  Zero bytes skipped: %ju (%ju MB)\n",
+		    (uintmax_t)client->zero_skipped,
+		    (uintmax_t)(client->zero_skipped >> 20));
+	if ((client->ext_flags & NETDUMP_EXT_FEC) != 0)
+		client_pinfo(client,
+		    "  FEC: %ju packets recovered, %ju parity packets\n",
+		    (uintmax_t)client->fec_recovered,
+		    (uintmax_t)client->fec_parity);
+	if (client->lz4_pkts > 0)
+		client_pinfo(client,
+		    "  LZ4: %ju packets, %ju bytes from %ju (%.2f:1)\n",
+		    (uintmax_t)client->lz4_pkts,
+		    (uintmax_t)client->lz4_rawbytes,
+		    (uintmax_t)client->lz4_bytes,
+		    (double)client->lz4_rawbytes / client->lz4_bytes);
+	client_pinfo(client, "Dump complete\n");
+	send_ack(client, client->finish_seqno);
+	exec_handler(client, "success");
+	free_client(client);
+	return (1);
+}
+
+/*
+ * Look up a client's name in the cache. Entries are kept in LRU order, and
+ * expired ones are dropped.
+ */
+static struct name_entry *
+name_lookup(struct in_addr ip, time_t now)
+{
+	struct name_entry *ne;
+
+	TAILQ_FOREACH(ne, &g_names, link) {
+		if (ne->ip.s_addr == ip.s_addr)
+			break;
+	}
+	if (ne == NULL)
+		return (NULL);
+	TAILQ_REMOVE(&g_names, ne, link);
+	if (ne->expires <= now) {
+		free(ne);
+		g_nnames--;
+		return (NULL);
+	}
+	TAILQ_INSERT_HEAD(&g_names, ne, link);
+	return (ne);
+}
+
+/* Add an entry to the name cache, evicting the least recently used one. */
+static struct name_entry *
+name_insert(struct in_addr ip)
+{
+	struct name_entry *ne;
+
+	if (g_nnames == NAMECACHE_SIZE) {
+		ne = TAILQ_LAST(&g_names, name_entry_list);
+		TAILQ_REMOVE(&g_names, ne, link);
+		g_nnames--;
+	} else {
+		ne = malloc(sizeof(*ne));
+		if (ne == NULL) {
+			LOGERR_PERROR("malloc()");
+			return (NULL);
+		}
+	}
+	memset(ne, 0, sizeof(*ne));
+	ne->ip = ip;
+	TAILQ_INSERT_HEAD(&g_names, ne, link);
+	g_nnames++;
+	return (ne);
+}
+
+/* Hand an address to the resolver thread. */
+static int
+resolver_post(const struct sockaddr_in *saddr)
+{
+	struct name_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		LOGERR_PERROR("calloc()");
+		return (1);
+	}
+	req->saddr = *saddr;
+	pthread_mutex_lock(&g_resolver.lock);
+	STAILQ_INSERT_TAIL(&g_resolver.reqq, req, link);
+	pthread_cond_signal(&g_resolver.cv);
+	pthread_mutex_unlock(&g_resolver.lock);
+	return (0);
+}
+
+/*
+ * Resolve an address, stripping the domain from its name. Addresses without a
+ * name are known by their numeric form.
+ */
+static void
+resolver_lookup(cap_channel_t *capdns, struct name_req *req)
+{
+	char *firstdot;
+	int error;
+
+	error = cap_getnameinfo(capdns, (struct sockaddr *)&req->saddr,
+	    req->saddr.sin_len, req->hostname, sizeof(req->hostname), NULL, 0,
+	    NI_NAMEREQD);
+	if (error == 0) {
+		firstdot = strchr(req->hostname, '.');
+		if (firstdot)
+			*firstdot = '\0';
+		req->resolved = true;
+	} else
+		(void)inet_ntop(AF_INET, &req->saddr.sin_addr, req->hostname,
+		    sizeof(req->hostname));
+}
+
+static void *
+resolver_main(void *arg)
+{
+	struct kevent event;
+	struct name_req *req;
+	cap_channel_t *capdns;
+
+	capdns = arg;
+	EV_SET(&event, RESOLVER_EVENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	pthread_mutex_lock(&g_resolver.lock);
+	for (;;) {
+		while (STAILQ_EMPTY(&g_resolver.reqq) && !g_resolver.exiting)
+			pthread_cond_wait(&g_resolver.cv, &g_resolver.lock);
+		if (g_resolver.exiting)
+			break;
+		req = STAILQ_FIRST(&g_resolver.reqq);
+		STAILQ_REMOVE_HEAD(&g_resolver.reqq, link);
+		pthread_mutex_unlock(&g_resolver.lock);
+
+		resolver_lookup(capdns, req);
+
+		pthread_mutex_lock(&g_resolver.lock);
+		STAILQ_INSERT_TAIL(&g_resolver.doneq, req, link);
+		if (kevent(g_dispatcher.kq, &event, 1, NULL, 0, NULL) != 0)
+			LOGERR_PERROR("kevent(NOTE_TRIGGER)");
+	}
+	pthread_mutex_unlock(&g_resolver.lock);
+	return (NULL);
+}
+
+/*
+ * Start the resolver threads, each with a clone of the system.dns channel. The
+ * first one uses the channel itself.
+ */
+static int
+resolver_start(void)
+{
+	cap_channel_t *chan;
+	int error, i;
+
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		if (i == 0)
+			chan = g_capdns;
+		else if ((chan = cap_clone(g_capdns)) == NULL) {
+			LOGERR_PERROR("cap_clone()");
+			break;
+		}
+		error = pthread_create(&g_resolver.threads[i], NULL,
+		    resolver_main, chan);
+		if (error != 0) {
+			LOGERR("pthread_create(): %s\n", strerror(error));
+			if (i > 0)
+				cap_close(chan);
+			break;
+		}
+		g_resolver.chans[i] = chan;
+		g_resolver.nthreads++;
+	}
+	return (g_resolver.nthreads == 0);
+}
+
+/* Stop the resolver threads and discard outstanding lookups. */
+static void
+resolver_stop(void)
+{
+	struct name_req *req;
+	struct name_entry *ne;
+	int i;
+
+	pthread_mutex_lock(&g_resolver.lock);
+	g_resolver.exiting = true;
+	pthread_cond_broadcast(&g_resolver.cv);
+	pthread_mutex_unlock(&g_resolver.lock);
+	for (i = 0; i < g_resolver.nthreads; i++) {
+		(void)pthread_join(g_resolver.threads[i], NULL);
+		if (i > 0)
+			cap_close(g_resolver.chans[i]);
+	}
+	g_resolver.nthreads = 0;
+	while ((req = STAILQ_FIRST(&g_resolver.reqq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&g_resolver.reqq, link);
+		free(req);
+	}
+	while ((req = STAILQ_FIRST(&g_resolver.doneq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&g_resolver.doneq, link);
+		free(req);
+	}
+	while ((ne = TAILQ_FIRST(&g_names)) != NULL) {
+		TAILQ_REMOVE(&g_names, ne, link);
+		free(ne);
+	}
+	g_nnames = 0;
+}
+
+/* Account for the time a herald waited for its ACK. */
+static void
+herald_latency(const struct netdump_herald *nh)
+{
+	struct timeval tv;
+	uint64_t now;
+	int b;
+
+	if (nh->nh_rcvtime == 0)
+		return;
+	(void)gettimeofday(&tv, NULL);
+	now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	b = 0;
+	if (now > nh->nh_rcvtime)
+		b = flsll((long long)(now - nh->nh_rcvtime));
+	g_herald_lat[MIN(b, LATENCY_BUCKETS - 1)]++;
+	g_herald_nlat++;
+}
+
+/* Return an upper bound of the given percentile of herald ACK latencies. */
+static uint64_t
+herald_latency_pct(int pct)
+{
+	uint64_t cum, target;
+	int b;
+
+	target = (g_herald_nlat * pct + 99) / 100;
+	cum = 0;
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+		cum += g_herald_lat[b];
+		if (cum >= target)
+			break;
+	}
+	return ((uint64_t)1 << b);
+}
+
+static void
+herald_latency_report(void)
+{
+
+	if (g_herald_nlat == g_herald_nlat_last)
+		return;
+	g_herald_nlat_last = g_herald_nlat;
+	LOGINFO("Herald ACK latency: p50 %ju us, p90 %ju us, p99 %ju us "
+	    "(%ju heralds)\n", (uintmax_t)herald_latency_pct(50),
+	    (uintmax_t)herald_latency_pct(90), (uintmax_t)herald_latency_pct(99),
+	    (uintmax_t)g_herald_nlat);
+}
+
+/*
+ * Start servicing a dump, naming its files after the client. A provisional
+ * name is replaced once the resolver answers. The herald's sockets and path
+ * are consumed.
+ */
+static void
+herald_start(struct netdump_herald *nh, const char *hostname,
+    bool provisional)
+{
+	struct sockaddr_in sin;
+	struct netdump_client *client, *stream;
+	socklen_t slen;
+	int i;
+
+	/* path is always consumed or freed by alloc_client(). */
+	client = alloc_client(nh->nh_sds[0], &nh->nh_sin, hostname,
+	    nh->nh_path, &nh->nh_ext);
+	nh->nh_path = NULL;
+	if (client == NULL) {
+		LOGERR(
+		    "server_event(): new client allocation failure\n");
+		for (i = 1; i < nh->nh_nsds; i++)
+			(void)close(nh->nh_sds[i]);
+		return;
+	}
+
+	/*
+	 * Streams are numbered in the order their sockets were created, so
+	 * the first one that can't be set up ends the list.
+	 */
+	client->nstreams = 1;
+	for (i = 1; i < nh->nh_nsds; i++) {
+		if (client->nstreams < i) {
+			(void)close(nh->nh_sds[i]);
+			continue;
+		}
+		slen = sizeof(sin);
+		if (getsockname(nh->nh_sds[i], (struct sockaddr *)&sin,
+		    &slen) != 0) {
+			LOGERR_PERROR("getsockname()");
+			(void)close(nh->nh_sds[i]);
+			continue;
+		}
+		stream = alloc_stream(client, nh->nh_sds[i]);
+		if (stream == NULL)
+			continue;
+		atomic_fetch_add(&stream->refs, 1);
+		client->streams[i] = stream;
+		client->stream_ports[i] = sin.sin_port;
+		client->nstreams++;
+	}
+	if (client->nstreams > 1)
+		client->ext_flags |= NETDUMP_EXT_STREAMS;
+	client->provisional = provisional;
+
+	client_pinfo(client, "Dump from %s [%s]\n", client->hostname,
+	    client_ntoa(client));
+	LOGINFO("%s dump from client %s [%s] (to %s)\n",
+	    client->resumed ? "Resumed" : "New", client->hostname,
+	    client_ntoa(client), client->corefilename);
+	if ((client->ext_flags & NETDUMP_EXT_DATASIZE) != 0)
+		client_pinfo(client, "  Payload size: %u\n", client->datasize);
+	if ((client->ext_flags & NETDUMP_EXT_WINDOW) != 0)
+		client_pinfo(client, "  Flow control: windowed\n");
+	if ((client->ext_flags & NETDUMP_EXT_SACK) != 0)
+		client_pinfo(client, "  Selective ACKs: yes\n");
+	if ((client->ext_flags & NETDUMP_EXT_DELACK) != 0)
+		client_pinfo(client, "  Delayed ACKs: every %u packets or %u us\n",
+		    client->delack_pkts, client->delack_usec);
+	if (client->nstreams > 1)
+		client_pinfo(client, "  Streams: %d\n", client->nstreams);
+	if ((client->ext_flags & NETDUMP_EXT_FEC) != 0)
+		client_pinfo(client, "  FEC: parity every %u packets\n",
+		    client->fec_group);
+	if ((client->ext_flags & NETDUMP_EXT_LZ4) != 0)
+		client_pinfo(client, "  Wire compression: LZ4\n");
+	if (client->resumed)
+		client_pinfo(client, "  Resumed: %jd bytes already received\n",
+		    (intmax_t)client->resume_off);
+	else if (client->token != 0)
+		client_pinfo(client, "  Resumable: yes\n");
+	client->ack_cum = nh->nh_seqno;
+	send_herald_ack(client, nh->nh_seqno);
+	herald_latency(nh);
+	for (i = 1; i < client->nstreams; i++)
+		client_attach(client->streams[i]);
+	client_attach(client);
+}
+
+/* Discard a herald without servicing it. */
+static void
+herald_drop(struct netdump_herald *nh)
+{
+	int i;
+
+	for (i = 0; i < nh->nh_nsds; i++)
+		(void)close(nh->nh_sds[i]);
+	free(nh->nh_path);
+}
+
+/*
+ * Start the dumps of heralds whose client's name is resolved, or whose
+ * deadline has passed.
+ */
+static void
+herald_expire(time_t now)
+{
+	struct herald_pending *hp, *tmp;
+	char ipstr[INET_ADDRSTRLEN];
+
+	TAILQ_FOREACH_SAFE(hp, &g_heralds, link, tmp) {
+		if (hp->deadline > now)
+			continue;
+		TAILQ_REMOVE(&g_heralds, hp, link);
+		(void)inet_ntop(AF_INET, &hp->nh.nh_sin.sin_addr, ipstr,
+		    sizeof(ipstr));
+		LOGWARN("Timed out resolving the name of %s\n", ipstr);
+		herald_start(&hp->nh, ipstr, false);
+		free(hp);
+	}
+}
+
+/* Discard the heralds still waiting at exit. */
+static void
+herald_flush(void)
+{
+	struct herald_pending *hp;
+
+	while ((hp = TAILQ_FIRST(&g_heralds)) != NULL) {
+		TAILQ_REMOVE(&g_heralds, hp, link);
+		herald_drop(&hp->nh);
+		free(hp);
+	}
+}
+
+/*
+ * Ask the owners of dumps started under a client's address to rename them,
+ * now that the client's name is known.
+ */
+static void
+resolver_rename(const struct name_req *req)
+{
+	struct netdump_client *client;
+
+	pthread_mutex_lock(&g_clients_lock);
+	LIST_FOREACH(client, CLIENT_HASH(req->saddr.sin_addr), iter) {
+		if (client->ip.s_addr != req->saddr.sin_addr.s_addr ||
+		    client->parent != NULL || !client->provisional ||
+		    client->expiring)
+			continue;
+		/* Only this thread looks at provisional. */
+		client->provisional = false;
+		(void)strlcpy(client->newname, req->hostname,
+		    sizeof(client->newname));
+		client_request(client, CLIENT_REQ_RENAME);
+	}
+	pthread_mutex_unlock(&g_clients_lock);
+}
+
+/*
+ * Cache the names found by the resolver, rename the dumps started without
+ * them, and start the heralds waiting for them.
+ */
+static void
+resolver_done(void)
+{
+	STAILQ_HEAD(, name_req) done;
+	struct herald_pending *hp, *tmp;
+	struct name_entry *ne;
+	struct name_req *req;
+
+	STAILQ_INIT(&done);
+	pthread_mutex_lock(&g_resolver.lock);
+	STAILQ_CONCAT(&done, &g_resolver.doneq);
+	pthread_mutex_unlock(&g_resolver.lock);
+
+	while ((req = STAILQ_FIRST(&done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done, link);
+		ne = name_lookup(req->saddr.sin_addr, g_dispatcher.now);
+		if (ne == NULL)
+			ne = name_insert(req->saddr.sin_addr);
+		if (ne != NULL) {
+			memcpy(ne->hostname, req->hostname,
+			    sizeof(ne->hostname));
+			ne->pending = false;
+			ne->expires = g_dispatcher.now + (req->resolved ?
+			    NAMECACHE_TTL : NAMECACHE_NEGTTL);
+		}
+		if (req->resolved)
+			resolver_rename(req);
+		TAILQ_FOREACH_SAFE(hp, &g_heralds, link, tmp) {
+			if (hp->nh.nh_sin.sin_addr.s_addr !=
+			    req->saddr.sin_addr.s_addr)
+				continue;
+			TAILQ_REMOVE(&g_heralds, hp, link);
+			herald_start(&hp->nh, req->hostname, false);
+			free(hp);
+		}
+		free(req);
+	}
+}
+
+/* Set up a dump for a herald received by the herald service. */
+static void
+herald_receive(struct netdump_herald *nh)
+{
+	char ipstr[INET_ADDRSTRLEN], resumepath[MAXPATHLEN];
+	struct herald_pending *hp;
+	struct netdump_client *client;
+	struct name_entry *ne;
+	uint64_t token;
+
+	/* The client retransmitted a herald that is waiting for its name. */
+	TAILQ_FOREACH(hp, &g_heralds, link) {
+		if (hp->nh.nh_sin.sin_addr.s_addr ==
+		    nh->nh_sin.sin_addr.s_addr) {
+			herald_drop(nh);
+			return;
+		}
+	}
+
+	token = 0;
+	if (nh->nh_ext.nhe_magic == NETDUMP_EXT_MAGIC &&
+	    (nh->nh_ext.nhe_flags & NETDUMP_EXT_RESUME) != 0)
+		token = nh->nh_ext.nhe_token;
+
+	/*
+	 * The clients lock keeps clients owned by worker threads from being
+	 * freed while we look at them. Clients owned by the dispatcher can only
+	 * be freed by this thread.
+	 */
+	pthread_mutex_lock(&g_clients_lock);
+	LIST_FOREACH(client, CLIENT_HASH(nh->nh_sin.sin_addr), iter) {
+		if (client->ip.s_addr == nh->nh_sin.sin_addr.s_addr &&
+		    client->parent == NULL && (!client->expiring ||
+		    (token != 0 && client->token == token)))
+			break;
+	}
+
+	if (client != NULL) {
+		if (!client->expiring && !client->any_data_rcvd) {
+			/* retransmit of the herald packet */
+			send_herald_ack(client, nh->nh_seqno);
+			pthread_mutex_unlock(&g_clients_lock);
+			herald_drop(nh);
+			return;
+		}
+		if (token != 0 && client->token == token &&
+		    (client->expiring || client->worker != &g_dispatcher)) {
+			/*
+			 * The dump being resumed has to save its state first,
+			 * on the thread that owns it. A retransmitted herald
+			 * carries on with the dump once it is gone.
+			 */
+			if (!client->expiring) {
+				client->expiring = true;
+				client_request(client, CLIENT_REQ_EXPIRE);
+			}
+			pthread_mutex_unlock(&g_clients_lock);
+			herald_drop(nh);
+			return;
+		}
+		client->expiring = true;
+		if (client->worker != &g_dispatcher) {
+			client_request(client, CLIENT_REQ_EXPIRE);
+			client = NULL;
+		}
+	}
+	pthread_mutex_unlock(&g_clients_lock);
+	if (client != NULL)
+		handle_timeout(client);
+
+	/*
+	 * The client's name is used to name the dump's files. Unless it is
+	 * cached, the dump is started under the client's address and renamed
+	 * once the resolver answers, so that lookups never hold up the herald's
+	 * ACK.
+	 */
+	ne = name_lookup(nh->nh_sin.sin_addr, g_dispatcher.now);
+	if (ne != NULL && !ne->pending) {
+		herald_start(nh, ne->hostname, false);
+		return;
+	}
+	if (ne == NULL) {
+		if (resolver_post(&nh->nh_sin) != 0) {
+			herald_drop(nh);
+			return;
+		}
+		ne = name_insert(nh->nh_sin.sin_addr);
+		if (ne != NULL) {
+			ne->pending = true;
+			ne->expires = g_dispatcher.now + NAMECACHE_PENDTTL;
+		}
+	}
+	(void)inet_ntop(AF_INET, &nh->nh_sin.sin_addr, ipstr, sizeof(ipstr));
+	if (token == 0) {
+		herald_start(nh, ipstr, true);
+		return;
+	}
+
+	/*
+	 * A resumed dump has to find its state under the name it was saved
+	 * with, so it waits for the client's name unless its state was saved
+	 * under the address.
+	 */
+	if (resume_filename(ipstr, token, nh->nh_path != NULL ?
+	    nh->nh_path : g_defpath, resumepath, sizeof(resumepath)) == 0 &&
+	    faccessat(g_dumpdir_fd, resumepath, F_OK, 0) == 0) {
+		herald_start(nh, ipstr, false);
 		return;
 	}
-	symlinktarget = strdup(client->infofilename);
-	if (symlinkat(basename(symlinktarget), g_dumpdir_fd,
-	    symlinkpath) != 0) {
-		LOGERR_PERROR("symlink()");
-		free(symlinktarget);
+	hp = malloc(sizeof(*hp));
+	if (hp == NULL) {
+		LOGERR_PERROR("malloc()");
+		herald_drop(nh);
 		return;
 	}
-	free(symlinktarget);
-
-	LOGINFO("Completed dump from client %s [%s]\n", client->hostname,
-	    client_ntoa(client));
-	client_pinfo(client, "Dump complete\n");
-	send_ack(client, pkt->hdr.mh_seqno);
-	exec_handler(client, "success");
-	free_client(client);
+	hp->nh = *nh;
+	hp->deadline = g_dispatcher.now + RESOLVE_TIMEOUT;
+	TAILQ_INSERT_TAIL(&g_heralds, hp, link);
 }
 
-/* Handle a read event on the server socket. */
+/*
+ * Handle a read event on the server socket. The herald service hands us every
+ * herald queued on the socket, up to a limit, in one round trip.
+ */
 static void
 server_event(void)
 {
-	char *path;
-	struct sockaddr_in saddr;
-	struct netdump_client *client;
-	uint32_t seqno;
-	int error, sd;
+	struct netdump_herald heralds[NETDUMP_HERALDS_MAX];
+	int error, i, nheralds;
 
-	error = netdump_cap_herald(g_capherald, &sd, &saddr, &seqno, &path);
+	error = netdump_cap_herald(g_capherald, g_maxstreams, heralds,
+	    nitems(heralds), &nheralds);
 	if (error != 0) {
 		LOGERR("netdump_cap_herald(): %s\n", strerror(error));
 		return;
 	}
+	for (i = 0; i < nheralds; i++)
+		herald_receive(&heralds[i]);
+}
 
-	LIST_FOREACH(client, &g_clients, iter) {
-		if (client->ip.s_addr == saddr.sin_addr.s_addr)
-			break;
+/*
+ * Receive up to CLIENT_BATCH datagrams from a client socket into its event
+ * loop's batch. Returns the number of packets received, or -1 if the socket returned
+ * an unexpected error.
+ *
+ * Headers are received into the batch, while payloads are scattered into
+ * consecutive slots, each the size of the client's largest payload, following
+ * any data already in the client's vmcore buffer. A stream of full-sized,
+ * contiguous VMCORE packets thus lands exactly where handle_vmcore() wants it.
+ * A packet's slot never precedes its final position in the buffer, so
+ * handle_vmcore() may always move data towards the front of the buffer without
+ * clobbering packets that have yet to be processed.
+ */
+static int
+client_recv(struct netdump_client *client)
+{
+	struct msghdr *msg;
+	struct netdump_worker *w;
+	ssize_t off;
+	int i;
+#ifdef HAVE_RECVMMSG
+	ssize_t n;
+#else
+	ssize_t len;
+	int n;
+#endif
+
+	w = client->worker;
+	for (i = 0; i < CLIENT_BATCH; i++) {
+		off = client->vb->len + (ssize_t)i * client->datasize;
+		if (off + client->datasize <= (ssize_t)g_vbsize)
+			w->pkts[i].data = client->vb->data + off;
+		else
+			w->pkts[i].data = w->pktovfl[i];
+		w->pktiovs[i][0].iov_base = &w->pkts[i].hdr;
+		w->pktiovs[i][0].iov_len = sizeof(w->pkts[i].hdr);
+		w->pktiovs[i][1].iov_base = w->pkts[i].data;
+		w->pktiovs[i][1].iov_len = client->datasize;
+
+		msg = PKTMSG(w, i);
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_iov = w->pktiovs[i];
+		msg->msg_iovlen = nitems(w->pktiovs[i]);
 	}
 
-	if (client != NULL) {
-		if (!client->any_data_rcvd) {
-			/* retransmit of the herald packet */
-			send_ack(client, seqno);
-			return;
+#ifdef HAVE_RECVMMSG
+	client->rcv_syscalls++;
+	n = recvmmsg(client->sock, w->pktmsgs, CLIENT_BATCH, 0, NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		LOGERR_PERROR("recvmmsg()");
+		return (-1);
+	}
+	for (i = 0; i < n; i++)
+		w->pktlens[i] = w->pktmsgs[i].msg_len;
+	return ((int)n);
+#else
+	/* Fall back to draining the socket one datagram at a time. */
+	for (n = 0; n < CLIENT_BATCH; n++) {
+		client->rcv_syscalls++;
+		len = recvmsg(client->sock, PKTMSG(w, n), 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			LOGERR_PERROR("recvmsg()");
+			return (n > 0 ? n : -1);
 		}
-		handle_timeout(client);
+		w->pktlens[n] = len;
 	}
+	return (n);
+#endif
+}
 
-	/* path is always consumed or freed by alloc_client(). */
-	client = alloc_client(sd, &saddr, path);
-	path = NULL;
-	if (client == NULL) {
-		LOGERR(
-		    "server_event(): new client allocation failure\n");
-		return;
+/*
+ * Return the parity group of a seqno, starting to track it if it is newer than
+ * the group in its slot. Returns NULL if the group was evicted already, or if
+ * no state could be allocated.
+ */
+static struct fec_group *
+fec_lookup(struct netdump_client *client, uint32_t seqno)
+{
+	struct fec_group *g;
+	uint32_t first;
+	int i;
+
+	if (client->fec == NULL) {
+		client->fec = calloc(1, sizeof(*client->fec) +
+		    (size_t)FEC_GROUPS * client->datasize);
+		if (client->fec == NULL) {
+			LOGERR_PERROR("calloc()");
+			return (NULL);
+		}
+		for (i = 0; i < FEC_GROUPS; i++)
+			client->fec->groups[i].data = client->fec->data +
+			    (size_t)i * client->datasize;
 	}
 
-	client_pinfo(client, "Dump from %s [%s]\n", client->hostname,
-	    client_ntoa(client));
-	LOGINFO("New dump from client %s [%s] (to %s)\n", client->hostname,
-	    client_ntoa(client), client->corefilename);
-	send_ack(client, seqno);
+	first = seqno - seqno % client->fec_group;
+	g = &client->fec->groups[(first / client->fec_group) % FEC_GROUPS];
+	if (g->used && g->first == first)
+		return (g);
+	if (g->used && (int32_t)(first - g->first) < 0)
+		return (NULL);
+	if (g->pending)
+		client->fec->npending--;
+	g->used = true;
+	g->first = first;
+	g->rcvd = 0;
+	g->nrcvd = 0;
+	g->parity = g->pending = g->done = false;
+	g->off = 0;
+	g->len = 0;
+	memset(g->data, 0, client->datasize);
+	return (g);
 }
 
-/* Handle a read event on a client socket. */
+/*
+ * Fold a VMCORE or parity message into its parity group. A message that can
+ * be rebuilt is only handled once the whole batch has been, since rebuilding
+ * it here could overwrite payloads of the batch received in place.
+ */
 static void
-client_event(struct netdump_client *client)
+fec_input(struct netdump_client *client, struct netdump_pkt *pkt)
 {
-	struct netdump_pkt pkt;
-	ssize_t len;
+	struct netdump_fec nf;
+	struct fec_group *g;
+	const uint8_t *data;
+	uint64_t bit, range;
+	uint32_t i, len;
+
+	g = fec_lookup(client, pkt->hdr.mh_seqno);
+	if (g == NULL || g->done)
+		return;
 
-	if ((len = recv(client->sock, &pkt, sizeof(pkt), 0)) < 0) {
-		if (errno != EAGAIN && errno != EINTR) {
-			LOGERR_PERROR("recv()");
-			handle_timeout(client);
+	if (pkt->hdr.mh_type == NETDUMP_PARITY) {
+		if (g->parity || pkt->hdr.mh_len < sizeof(nf))
+			return;
+		memcpy(&nf, pkt->data, sizeof(nf));
+		g->pfirst = pkt->hdr.mh_seqno;
+		g->count = ntohl(nf.nf_count);
+		if (g->count == 0 ||
+		    g->pfirst - g->first + g->count > client->fec_group) {
+			LOGERR("Ignoring bad parity message from %s\n",
+			    client_ntoa(client));
+			return;
 		}
+		g->parity = true;
+		client->fec_parity++;
+		g->off ^= be64toh(nf.nf_offset);
+		g->len ^= ntohl(nf.nf_len);
+		data = pkt->data + sizeof(nf);
+		len = pkt->hdr.mh_len - sizeof(nf);
+	} else {
+		bit = 1ULL << (pkt->hdr.mh_seqno - g->first);
+		if ((g->rcvd & bit) != 0)
+			return;
+		g->rcvd |= bit;
+		g->nrcvd++;
+		g->off ^= pkt->hdr.mh_offset;
+		g->len ^= pkt->hdr.mh_len;
+		data = pkt->data;
+		len = pkt->hdr.mh_len;
+	}
+	for (i = 0; i < len; i++)
+		g->data[i] ^= data[i];
+
+	if (!g->parity || g->nrcvd + 1 < g->count)
 		return;
+	g->done = true;
+	if (g->nrcvd + 1 == g->count) {
+		/* Exactly one message covered by the parity is missing. */
+		range = (g->count == 64 ? ~0ULL : (1ULL << g->count) - 1) <<
+		    (g->pfirst - g->first);
+		if ((g->rcvd & ~range) != 0 || g->len == 0 ||
+		    g->len > client->datasize) {
+			LOGERR("Parity group %u from %s is inconsistent\n",
+			    g->first, client_ntoa(client));
+			return;
+		}
+		g->pending = true;
+		client->fec->npending++;
+	}
+}
+
+/*
+ * Handle the messages rebuilt from parity during the last batch. Returns 1 if
+ * the client was freed, 0 otherwise.
+ */
+static int
+fec_recover(struct netdump_client *client)
+{
+	struct netdump_pkt pkt;
+	struct fec_group *g;
+	uint64_t range;
+	int i;
+
+	if (client->fec == NULL || client->fec->npending == 0)
+		return (0);
+	for (i = 0; i < FEC_GROUPS; i++) {
+		g = &client->fec->groups[i];
+		if (!g->pending)
+			continue;
+		g->pending = false;
+		client->fec->npending--;
+		range = (g->count == 64 ? ~0ULL : (1ULL << g->count) - 1) <<
+		    (g->pfirst - g->first);
+		pkt.hdr.mh_type = NETDUMP_VMCORE;
+		pkt.hdr.mh_seqno = g->first + ffsll(range & ~g->rcvd) - 1;
+		pkt.hdr.mh_offset = g->off;
+		pkt.hdr.mh_len = g->len;
+		pkt.data = g->data;
+		client->fec_recovered++;
+		if (handle_vmcore(client, &pkt) != 0)
+			return (1);
 	}
+	return (0);
+}
+
+/*
+ * Validate and handle a single packet from a client. Returns 1 if the client
+ * was freed as a result, 0 otherwise.
+ */
+static int
+client_dispatch(struct netdump_client *client, struct netdump_pkt *pkt,
+    ssize_t len)
+{
 
 	if ((size_t)len < sizeof(struct netdump_msg_hdr)) {
 		LOGERR("Ignoring runt packet from %s (got %zu)\n",
 		    client_ntoa(client), (size_t)len);
-		return;
+		return (0);
 	}
 
-	ndtoh(&pkt.hdr);
+	ndtoh(&pkt->hdr);
 
-	if ((size_t)len - sizeof(struct netdump_msg_hdr) != pkt.hdr.mh_len) {
+	if ((size_t)len - sizeof(struct netdump_msg_hdr) != pkt->hdr.mh_len) {
 		LOGERR("Bad packet size from %s\n", client_ntoa(client));
-		return;
+		return (0);
 	}
 
-	client->last_msg = time(NULL);
+	if (client->worker->now - client->last_msg > client->max_gap)
+		client->max_gap = client->worker->now - client->last_msg;
+	client->last_msg = client->worker->now;
+	client->worker->rcv_bytes += pkt->hdr.mh_len;
+
+	/* Streams only carry data, and nothing more once drained. */
+	if (client->parent != NULL && (client->drained ||
+	    (pkt->hdr.mh_type != NETDUMP_VMCORE &&
+	    pkt->hdr.mh_type != NETDUMP_VMCORE_LZ4 &&
+	    pkt->hdr.mh_type != NETDUMP_PARITY))) {
+		if (!client->drained)
+			LOGERR("Ignoring message type %d on a stream from %s\n",
+			    pkt->hdr.mh_type, client_ntoa(client));
+		return (0);
+	}
 
-	switch (pkt.hdr.mh_type) {
+	switch (pkt->hdr.mh_type) {
 	case NETDUMP_KDH:
-		handle_kdh(client, &pkt);
-		break;
+		return (handle_kdh(client, pkt));
 	case NETDUMP_EKCD_KEY:
-		handle_ekcd_key(client, &pkt);
+		handle_ekcd_key(client, pkt);
 		break;
 	case NETDUMP_VMCORE:
-		handle_vmcore(client, &pkt);
-		break;
+		if (client->fec_group != 0)
+			fec_input(client, pkt);
+		return (handle_vmcore(client, pkt));
+	case NETDUMP_VMCORE_LZ4:
+		if ((client->ext_flags & NETDUMP_EXT_LZ4) != 0)
+			return (handle_vmcore_lz4(client, pkt));
+		goto unexpected;
 	case NETDUMP_FINISHED:
-		handle_finish(client, &pkt);
-		break;
+		return (handle_finish(client, pkt));
+	case NETDUMP_PARITY:
+		if (client->fec_group != 0) {
+			fec_input(client, pkt);
+			break;
+		}
+		/* FALLTHROUGH */
 	default:
+unexpected:
 		LOGERR("Received unexpected message type %d from %s\n",
-		    pkt.hdr.mh_type, client_ntoa(client));
+		    pkt->hdr.mh_type, client_ntoa(client));
 		break;
 	}
+	return (0);
+}
+
+/*
+ * Handle a read event on a client socket. We drain a batch of packets per
+ * event rather than returning to kevent() after each one.
+ */
+static void
+client_event(struct netdump_client *client)
+{
+	struct netdump_worker *w;
+	int i, n;
+
+	/* The client may have been freed earlier in this batch of events. */
+	if (client->dead)
+		return;
+
+	w = client->worker;
+	client->rcv_events++;
+
+	/* Make sure that at least one payload can be received in place. */
+	if (client->vb->len + client->datasize > (ssize_t)g_vbsize &&
+	    vmcore_flush(client) != 0)
+		return;
+
+	n = client_recv(client);
+	if (n < 0) {
+		handle_timeout(client);
+		return;
+	}
+	client->rcv_pkts += n;
+	w->rcv_pkts += n;
+	if (client->parent != NULL) {
+		atomic_store(&client->parent->stream_msg, w->now);
+		atomic_store(&client->parent->any_data_rcvd, true);
+	}
+
+	client->ack_batching = true;
+	for (i = 0; i < n; i++)
+		if (client_dispatch(client, &w->pkts[i], w->pktlens[i]) != 0)
+			/* The client is gone. */
+			return;
+	if (fec_recover(client) != 0)
+		return;
+	client->ack_batching = false;
+	send_acks(client);
+	if (vmcore_reorder_drain(client) != 0)
+		return;
+	vmcore_commit(client);
+	client_window_update(client);
+}
+
+/* Wake up an event loop so that it processes its request queue. */
+static void
+worker_wakeup(struct netdump_worker *w)
+{
+	struct kevent event;
+
+	EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	if (kevent(w->kq, &event, 1, NULL, 0, NULL) != 0)
+		LOGERR_PERROR("kevent(NOTE_TRIGGER)");
+}
+
+/* Process requests posted to an event loop by other threads. */
+static void
+worker_requests(struct netdump_worker *w)
+{
+	struct netdump_client *client;
+	int reqs;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		client = STAILQ_FIRST(&w->reqq);
+		if (client != NULL) {
+			STAILQ_REMOVE_HEAD(&w->reqq, reqlink);
+			reqs = client->reqs;
+			client->reqs = 0;
+		}
+		pthread_mutex_unlock(&w->lock);
+		if (client == NULL)
+			break;
+
+		if ((reqs & CLIENT_REQ_ADOPT) != 0)
+			client_adopt(client);
+		if ((reqs & CLIENT_REQ_EXPIRE) != 0 && !client->dead) {
+			if (client->parent != NULL) {
+				/* The dump is gone. */
+				client->expiring = true;
+				free_client(client);
+			} else
+				handle_timeout(client);
+		}
+		if ((reqs & CLIENT_REQ_WERROR) != 0 && !client->dead)
+			vmcore_error(client, client->werrno, client->werroff);
+		if ((reqs & CLIENT_REQ_RESUME) != 0 && !client->dead) {
+			vmcore_commit(client);
+			client_window_update(client);
+		}
+		if ((reqs & CLIENT_REQ_SYNCED) != 0 && !client->dead)
+			(void)client_finish(client);
+		if ((reqs & CLIENT_REQ_DRAIN) != 0 && !client->dead) {
+			client->drained = true;
+			if (vmcore_finish(client) == 0)
+				vmcore_commit(client);
+		}
+		if ((reqs & CLIENT_REQ_STREAMS) != 0 && !client->dead) {
+			client_streams_merge(client);
+			if (vmcore_finish(client) == 0)
+				vmcore_commit(client);
+		}
+		if ((reqs & CLIENT_REQ_RENAME) != 0 && !client->dead)
+			client_rename(client);
+		if ((reqs & CLIENT_REQ_SFAIL) != 0 && !client->dead) {
+			client_pinfo(client,
+			    "Dump unsuccessful: a stream failed\n");
+			exec_handler(client, "error");
+			free_client(client);
+		}
+	}
+}
+
+/* Reclaim clients freed while processing the last batch of events. */
+static void
+worker_reap(struct netdump_worker *w)
+{
+	struct netdump_client *client;
+
+	while ((client = LIST_FIRST(&w->dead)) != NULL) {
+		LIST_REMOVE(client, witer);
+		client_rele(client);
+	}
+}
+
+/*
+ * Time out all of an event loop's clients at shutdown. Call it a timeout so
+ * that the scripts get run.
+ */
+static void
+worker_drain(struct netdump_worker *w)
+{
+
+	worker_requests(w);
+	while (!LIST_EMPTY(&w->clients))
+		handle_timeout(LIST_FIRST(&w->clients));
+	worker_reap(w);
+
+	if (w->ndumps > 0)
+		LOGINFO("Worker %d: %ju dumps, %ju packets, %ju bytes received\n",
+		    w->id, (uintmax_t)w->ndumps, (uintmax_t)w->rcv_pkts,
+		    (uintmax_t)w->rcv_bytes);
 }
 
 static int
-eventloop(void)
+worker_loop(struct netdump_worker *w)
 {
+	struct netdump_client *client;
 	struct kevent events[8];
 	struct timespec ts;
-	struct netdump_client *client;
 	int ev, rc;
 
-	LOGINFO("Waiting for clients.\n");
-
-	/* We check for timed-out clients regularly. */
-	ts.tv_sec = CLIENT_TPASS;
 	ts.tv_nsec = 0;
-
 	for (;;) {
-		rc = kevent(g_kq, NULL, 0, events, nitems(events), &ts);
+		/*
+		 * The timer wheel ticks every second while it holds clients,
+		 * as do heralds waiting for their client's name.
+		 */
+		ts.tv_sec = w->ntimers == 0 && (w != &g_dispatcher ||
+		    TAILQ_EMPTY(&g_heralds)) ? CLIENT_TPASS : 1;
+		rc = kevent(w->kq, NULL, 0, events, nitems(events), &ts);
 		if (rc < 0) {
 			if (errno == EINTR)
 				continue;
@@ -952,39 +4559,125 @@ eventloop(void)
 			return (1);
 		}
 
-		g_now = time(NULL);
+		w->now = time(NULL);
 		for (ev = 0; ev < rc; ev++) {
-			if (events[ev].filter == EVFILT_SIGNAL)
+			switch (events[ev].filter) {
+			case EVFILT_SIGNAL:
 				/* We received SIGINT or SIGTERM. */
-				goto out;
-
-			if (events[ev].filter == EVFILT_READ) {
+				return (0);
+			case EVFILT_USER:
+				if (atomic_load(&g_shutdown))
+					return (0);
+				if (events[ev].ident == RESOLVER_EVENT)
+					resolver_done();
+				else
+					worker_requests(w);
+				break;
+			case EVFILT_READ:
 				if ((int)events[ev].ident == g_sock)
 					server_event();
-				else {
-					client = events[ev].udata;
-					client_event(client);
-				}
-				continue;
+				else
+					client_event(events[ev].udata);
+				break;
+			case EVFILT_WRITE:
+				client = events[ev].udata;
+				if (!client->dead)
+					send_acks_pending(client);
+				break;
+			case EVFILT_TIMER:
+				client = events[ev].udata;
+				if (!client->dead)
+					delack_expire(client);
+				break;
+			case EVFILT_AIO:
+				client = events[ev].udata;
+				if (!client->dead)
+					vmcore_aio_done(client,
+					    (struct aiocb *)events[ev].ident);
+				break;
+			default:
+				LOGERR("unexpected event %d", events[ev].filter);
+				break;
 			}
-
-			LOGERR("unexpected event %d", events[ev].filter);
-			break;
 		}
 
-		timeout_clients();
+		if (w == &g_dispatcher)
+			herald_expire(w->now);
+		timeout_clients(w);
+		worker_reap(w);
+	}
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct netdump_worker *w;
+
+	w = arg;
+	if (worker_loop(w) != 0) {
+		LOGERR("Worker %d exiting on error\n", w->id);
+		pthread_mutex_lock(&g_clients_lock);
+		w->failed = true;
+		pthread_mutex_unlock(&g_clients_lock);
+	}
+	worker_drain(w);
+	return (NULL);
+}
+
+static int
+eventloop(void)
+{
+	int error, i, rc;
+
+	if (resolver_start() != 0)
+		return (1);
+	for (i = 0; i < g_nwriters; i++) {
+		error = pthread_create(&g_writers[i].thread, NULL, writer_main,
+		    &g_writers[i]);
+		if (error != 0) {
+			LOGERR("pthread_create(): %s\n", strerror(error));
+			g_nwriters = i;
+			rc = 1;
+			goto out;
+		}
+	}
+	for (i = 0; i < g_nworkers; i++) {
+		error = pthread_create(&g_workers[i].thread, NULL, worker_main,
+		    &g_workers[i]);
+		if (error != 0) {
+			LOGERR("pthread_create(): %s\n", strerror(error));
+			g_nworkers = i;
+			rc = 1;
+			goto out;
+		}
 	}
+
+	LOGINFO("Waiting for clients.\n");
+	rc = worker_loop(&g_dispatcher);
 out:
 	LOGINFO("Shutting down...");
 
-	/*
-	 * Clients is the head of the list, so clients != NULL iff the list
-	 * is not empty. Call it a timeout so that the scripts get run.
-	 */
-	while (!LIST_EMPTY(&g_clients))
-		handle_timeout(LIST_FIRST(&g_clients));
+	atomic_store(&g_shutdown, true);
+	for (i = 0; i < g_nworkers; i++)
+		worker_wakeup(&g_workers[i]);
+	for (i = 0; i < g_nworkers; i++)
+		(void)pthread_join(g_workers[i].thread, NULL);
+	worker_drain(&g_dispatcher);
+	herald_flush();
+	resolver_stop();
+	herald_latency_report();
+
+	/* Let the writers finish with whatever the clients left queued. */
+	for (i = 0; i < g_nwriters; i++) {
+		pthread_mutex_lock(&g_writers[i].lock);
+		g_writers[i].exiting = true;
+		pthread_cond_signal(&g_writers[i].cv);
+		pthread_mutex_unlock(&g_writers[i].lock);
+	}
+	for (i = 0; i < g_nwriters; i++)
+		(void)pthread_join(g_writers[i].thread, NULL);
 
-	return (0);
+	return (rc);
 }
 
 static char *
@@ -1071,6 +4764,7 @@ init_cap_mode(void)
 	}
 	limits = nvlist_create(0);
 	nvlist_add_descriptor(limits, "socket", g_sock);
+	nvlist_add_number(limits, "poolsize", g_herald_pool);
 	if (cap_limit_set(g_capherald, limits) != 0) {
 		LOGERR_PERROR("cap_limit_set(netdump.herald)");
 		goto err;
@@ -1099,20 +4793,93 @@ err:
 	return (error);
 }
 
+static int
+init_worker(struct netdump_worker *w, int id)
+{
+	struct kevent event;
+
+	w->id = id;
+	w->kq = kqueue();
+	if (w->kq < 0) {
+		LOGERR_PERROR("kqueue()");
+		return (1);
+	}
+	LIST_INIT(&w->clients);
+	LIST_INIT(&w->dead);
+	STAILQ_INIT(&w->reqq);
+	pthread_mutex_init(&w->lock, NULL);
+	w->now = w->last_timeout_check = w->wheel_tick = time(NULL);
+
+	EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(w->kq, &event, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EVFILT_USER)");
+		return (1);
+	}
+	return (0);
+}
+
+static int
+init_workers(void)
+{
+	int i;
+
+	if (g_nworkers == 0)
+		return (0);
+
+	g_workers = calloc(g_nworkers, sizeof(*g_workers));
+	if (g_workers == NULL) {
+		LOGERR_PERROR("calloc()");
+		return (1);
+	}
+	for (i = 0; i < g_nworkers; i++)
+		if (init_worker(&g_workers[i], i + 1) != 0)
+			return (1);
+	return (0);
+}
+
+static int
+init_writers(void)
+{
+	struct netdump_writer *wr;
+	int i;
+
+	if (g_nwriters == 0)
+		return (0);
+
+	g_writers = calloc(g_nwriters, sizeof(*g_writers));
+	if (g_writers == NULL) {
+		LOGERR_PERROR("calloc()");
+		return (1);
+	}
+	for (i = 0; i < g_nwriters; i++) {
+		wr = &g_writers[i];
+		wr->id = i;
+		pthread_mutex_init(&wr->lock, NULL);
+		pthread_cond_init(&wr->cv, NULL);
+		STAILQ_INIT(&wr->runq);
+	}
+	return (0);
+}
+
 static int
 init_kqueue(void)
 {
-	struct kevent sockev, sigev[2];
+	struct kevent sockev, sigev[2], userev;
 	sigset_t set;
 
-	g_kq = kqueue();
-	if (g_kq < 0) {
-		LOGERR_PERROR("kqueue()");
+	if (init_worker(&g_dispatcher, 0) != 0)
+		return (1);
+
+	/* Triggered by the resolver thread. */
+	EV_SET(&userev, RESOLVER_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+	    NULL);
+	if (kevent(g_dispatcher.kq, &userev, 1, NULL, 0, NULL) != 0) {
+		LOGERR_PERROR("kevent(EVFILT_USER)");
 		return (1);
 	}
 
 	EV_SET(&sockev, g_sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
-	if (kevent(g_kq, &sockev, 1, NULL, 0, NULL) != 0) {
+	if (kevent(g_dispatcher.kq, &sockev, 1, NULL, 0, NULL) != 0) {
 		LOGERR_PERROR("kevent(socket)");
 		return (1);
 	}
@@ -1125,7 +4892,7 @@ init_kqueue(void)
 	}
 	EV_SET(&sigev[0], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
 	EV_SET(&sigev[1], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-	if (kevent(g_kq, sigev, nitems(sigev), NULL, 0, NULL) != 0) {
+	if (kevent(g_dispatcher.kq, sigev, nitems(sigev), NULL, 0, NULL) != 0) {
 		LOGERR_PERROR("kevent(signals)");
 		return (1);
 	}
@@ -1158,6 +4925,12 @@ init_server_socket(void)
 		LOGERR_PERROR("setsockopt()");
 		return (1);
 	}
+	/* Heralds are timestamped to measure how long they wait for an ACK. */
+	if (setsockopt(g_sock, SOL_SOCKET, SO_TIMESTAMP, &one,
+	    sizeof(one)) != 0) {
+		LOGERR_PERROR("setsockopt()");
+		return (1);
+	}
 	memset(&bindaddr, 0, sizeof(bindaddr));
 	bindaddr.sin_len = sizeof(bindaddr);
 	bindaddr.sin_family = AF_INET;
@@ -1179,6 +4952,8 @@ main(int argc, char **argv)
 {
 	char pidfile[MAXPATHLEN];
 	struct stat statbuf;
+	const char *errstr;
+	uint64_t size;
 	int ch, exit_code;
 
 	openlog("netdumpd", LOG_PID | LOG_NDELAY, LOG_DAEMON);
@@ -1187,8 +4962,11 @@ main(int argc, char **argv)
 
 	exit_code = 1;
 	pidfile[0] = '\0';
-	while ((ch = getopt(argc, argv, "a:Dd:i:P:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "Aa:b:Dd:i:m:P:p:S:s:t:w:")) != -1) {
 		switch (ch) {
+		case 'A':
+			atomic_store(&g_aio, true);
+			break;
 		case 'a':
 			if (inet_aton(optarg, &g_bindip) == 0) {
 				warnx("invalid bind IP specified");
@@ -1196,6 +4974,15 @@ main(int argc, char **argv)
 			}
 			warnx("listening on IP %s", optarg);
 			break;
+		case 'b':
+			g_vbcount = (int)strtonum(optarg, 1, VMCORE_NBUF_MAX,
+			    &errstr);
+			if (errstr != NULL) {
+				warnx("number of buffers is %s: '%s'", errstr,
+				    optarg);
+				goto cleanup;
+			}
+			break;
 		case 'D':
 			g_debug = true;
 			break;
@@ -1211,6 +4998,15 @@ main(int argc, char **argv)
 			if (g_handler_script == NULL)
 				goto cleanup;
 			break;
+		case 'm':
+			g_maxstreams = (int)strtonum(optarg, 1,
+			    NETDUMP_STREAMS_MAX, &errstr);
+			if (errstr != NULL) {
+				warnx("number of streams is %s: '%s'", errstr,
+				    optarg);
+				goto cleanup;
+			}
+			break;
 		case 'P':
 			if (strlcpy(pidfile, optarg, sizeof(pidfile)) >=
 			    sizeof(pidfile)) {
@@ -1225,6 +5021,42 @@ main(int argc, char **argv)
 				goto cleanup;
 			}
 			break;
+		case 'S':
+			g_herald_pool = (int)strtonum(optarg, 0,
+			    NETDUMP_HERALD_POOL_MAX, &errstr);
+			if (errstr != NULL) {
+				warnx("number of herald sockets is %s: '%s'",
+				    errstr, optarg);
+				goto cleanup;
+			}
+			break;
+		case 's':
+			if (expand_number(optarg, &size) != 0 ||
+			    size < NETDUMP_DATASIZE || size > VMCORE_BUFSZ_MAX ||
+			    size % NETDUMP_DATASIZE != 0) {
+				warnx("invalid buffer size '%s'", optarg);
+				goto cleanup;
+			}
+			g_vbsize = size;
+			break;
+		case 't':
+			g_nworkers = (int)strtonum(optarg, 1, MAX_WORKERS,
+			    &errstr);
+			if (errstr != NULL) {
+				warnx("number of threads is %s: '%s'", errstr,
+				    optarg);
+				goto cleanup;
+			}
+			break;
+		case 'w':
+			g_nwriters = (int)strtonum(optarg, 1, MAX_WRITERS,
+			    &errstr);
+			if (errstr != NULL) {
+				warnx("number of writers is %s: '%s'", errstr,
+				    optarg);
+				goto cleanup;
+			}
+			break;
 		default:
 			usage();
 			goto cleanup;
@@ -1234,6 +5066,11 @@ main(int argc, char **argv)
 	argv += optind;
 	if (argc != 0)
 		usage();
+	if (atomic_load(&g_aio) && g_nwriters > 0) {
+		warnx("-A and -w are mutually exclusive");
+		goto cleanup;
+	}
+	g_vbpool_max = MAX(VMCORE_POOL_MAX / g_vbsize, 1);
 
 	g_pfh = pidfile_open(pidfile[0] != '\0' ? pidfile : NULL, 0600, NULL);
 	if (g_pfh == NULL) {
@@ -1285,6 +5122,10 @@ main(int argc, char **argv)
 		goto cleanup;
 	if (init_kqueue())
 		goto cleanup;
+	if (init_workers())
+		goto cleanup;
+	if (init_writers())
+		goto cleanup;
 	if (init_cap_mode())
 		goto cleanup;
 
@@ -1295,6 +5136,8 @@ cleanup:
 		warn("pidfile_remove");
 	(void)close(g_dumpdir_fd);
 	free(g_handler_script);
+	free(g_workers);
+	free(g_writers);
 	if (g_sock != -1)
 		close(g_sock);
 	if (g_capherald != NULL)
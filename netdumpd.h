@@ -26,13 +26,35 @@
 #ifndef _NETDUMPD_H_
 #define	_NETDUMPD_H_
 
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <netinet/netdump/netdump.h>
+
 struct cap_channel;
-struct sockaddr_in;
+
+#define	NETDUMP_HERALDS_MAX	64	/* Most heralds per request. */
+#define	NETDUMP_HERALD_POOL	32	/* Default pooled sockets per address. */
+#define	NETDUMP_HERALD_POOL_MAX	256	/* Most pooled sockets per address. */
+
+/* A herald received by the herald service, and the sockets created for it. */
+struct netdump_herald {
+	struct sockaddr_in nh_sin;	/* Client's ACK address. */
+	uint32_t	nh_seqno;
+	uint64_t	nh_rcvtime;	/* Arrival, in us since the Epoch. */
+	char		*nh_path;	/* Relative dump path, or NULL. */
+	struct netdump_herald_ext nh_ext; /* Zeroed if none requested. */
+	int		nh_nsds;
+	int		nh_sds[NETDUMP_STREAMS_MAX];
+};
 
 int	netdump_cap_handler(struct cap_channel *, const char *, const char *,
 	    const char *, const char *, const char *);
-int	netdump_cap_herald(struct cap_channel *, int *, struct sockaddr_in *,
-	    uint32_t *, char **);
+int	netdump_cap_herald(struct cap_channel *, int, struct netdump_herald *,
+	    int, int *);
+
+size_t	netdump_lz4_compress(const uint8_t *, size_t, uint8_t *, size_t);
+ssize_t	netdump_lz4_decompress(const uint8_t *, size_t, uint8_t *, size_t);
 
 #define	ndtoh(hdr) do {					\
 	(hdr)->mh_type = ntohl((hdr)->mh_type);		\
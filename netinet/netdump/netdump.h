@@ -45,6 +45,8 @@
 #define	NETDUMP_VMCORE		3	/* Contains dump data. */
 #define	NETDUMP_KDH		4	/* Contains kernel dump header. */
 #define	NETDUMP_EKCD_KEY	5
+#define	NETDUMP_PARITY		6	/* FEC parity, see NETDUMP_EXT_FEC. */
+#define	NETDUMP_VMCORE_LZ4	7	/* See NETDUMP_EXT_LZ4. */
 
 #define	NETDUMP_DATASIZE	4096	/* Arbitrary packet size limit. */
 
@@ -60,6 +62,144 @@ struct netdump_ack {
 	uint32_t	na_seqno;	/* Match acks with msgs. */
 } __packed;
 
+/*
+ * Protocol extensions. A herald may carry, following the NUL-terminated dump
+ * path (an empty string if there is none), a struct netdump_herald_ext
+ * requesting optional features. A server supporting extensions replies with a
+ * struct netdump_herald_ack carrying the features it accepted; otherwise the
+ * reply is a plain ACK and no extension may be used. Fields are in network
+ * byte order. The structures only grow at the end, and fields missing from a
+ * shorter structure are taken to be zero.
+ */
+#define	NETDUMP_EXT_MAGIC	0x6e646578	/* "ndex" */
+
+#define	NETDUMP_EXT_DATASIZE	0x00000001	/* Larger VMCORE payloads. */
+#define	NETDUMP_EXT_WINDOW	0x00000002	/* ACKs advertise a window. */
+#define	NETDUMP_EXT_SACK	0x00000004	/* ACKs list received ranges. */
+#define	NETDUMP_EXT_DELACK	0x00000008	/* Delayed cumulative ACKs. */
+#define	NETDUMP_EXT_STREAMS	0x00000010	/* Striping over several ports. */
+#define	NETDUMP_EXT_FEC		0x00000020	/* XOR parity messages. */
+#define	NETDUMP_EXT_RESUME	0x00000040	/* Resumable dumps. */
+#define	NETDUMP_EXT_LZ4		0x00000080	/* LZ4-compressed dump data. */
+
+#define	NETDUMP_DATASIZE_MAX	16384	/* Largest negotiable payload. */
+#define	NETDUMP_STREAMS_MAX	8	/* Most streams per dump. */
+#define	NETDUMP_FEC_GROUP_MAX	64	/* Largest parity group. */
+
+struct netdump_herald_ext {
+	uint32_t	nhe_magic;
+	uint32_t	nhe_flags;	/* Requested features. */
+	uint32_t	nhe_datasize;	/* Largest VMCORE payload to send. */
+	uint32_t	nhe_ackpkts;	/* Packets per delayed ACK. */
+	uint32_t	nhe_ackusec;	/* Longest ACK delay (microseconds). */
+	uint32_t	nhe_nstreams;	/* Streams wanted, including the first. */
+	uint32_t	nhe_fecgroup;	/* Seqnos per parity group. */
+	uint64_t	nhe_token;	/* Identifies a resumable dump. */
+} __packed;
+
+struct netdump_herald_ack {
+	uint32_t	nha_seqno;	/* As in struct netdump_ack. */
+	uint32_t	nha_magic;
+	uint32_t	nha_flags;	/* Accepted features. */
+	uint32_t	nha_datasize;	/* Largest VMCORE payload accepted. */
+	uint32_t	nha_window;	/* Initial window (bytes). */
+	uint32_t	nha_ackpkts;	/* Packets per delayed ACK accepted. */
+	uint32_t	nha_ackusec;	/* Longest ACK delay accepted. */
+	uint32_t	nha_nstreams;	/* Streams accepted. */
+	uint32_t	nha_stripe;	/* Stripe unit (bytes). */
+	uint16_t	nha_ports[NETDUMP_STREAMS_MAX]; /* Stream ports. */
+	uint32_t	nha_fecgroup;	/* Seqnos per parity group accepted. */
+	uint64_t	nha_resumeoff;	/* Data received so far (bytes). */
+} __packed;
+
+/*
+ * With NETDUMP_EXT_LZ4, dump data may also be sent in NETDUMP_VMCORE_LZ4
+ * messages, whose payload is a single LZ4 block, without any frame, holding at
+ * most nha_datasize bytes of data for offset mh_offset. They are otherwise
+ * handled like VMCORE messages, and a sender may mix both, for instance to send
+ * incompressible data or retransmissions as is. Windows count payload bytes as
+ * sent. NETDUMP_EXT_FEC is not accepted along with NETDUMP_EXT_LZ4.
+ */
+
+/*
+ * With NETDUMP_EXT_RESUME, the server saves what it has received of a dump that
+ * times out or is heralded again, keyed by the client and the non-zero
+ * nhe_token, and a later herald with the same token carries on with the same
+ * core file. nha_resumeoff is then the length of the data received from offset
+ * zero, which the sender need not send again; any other data the server already
+ * has is acknowledged and dropped as a duplicate. A herald may be left
+ * unanswered while the state of the dump is being saved, and should be
+ * retransmitted. Resumable dumps are not striped.
+ */
+
+/*
+ * With NETDUMP_EXT_STREAMS, VMCORE messages are striped over nha_nstreams
+ * streams: the one the herald ACK came from, numbered 0, and streams using the
+ * server ports listed in nha_ports[1] onwards. The message for offset off goes
+ * to stream (off / nha_stripe) % nha_nstreams, and must not cross a stripe
+ * boundary. Other messages only use stream 0. Each stream has its own seqno
+ * space, starting after the herald's seqno on stream 0 and at 1 on the others,
+ * and negotiated ACK extensions apply to each stream separately. FINISHED may
+ * only be sent once the data sent on every stream has been acknowledged.
+ */
+
+/*
+ * With NETDUMP_EXT_WINDOW or NETDUMP_EXT_SACK, ACKs are a struct
+ * netdump_ack_ext. It is truncated after na_window unless NETDUMP_EXT_SACK is
+ * in use, and after the last range listed otherwise.
+ *
+ * With NETDUMP_EXT_WINDOW, every ACK carries the amount of VMCORE payload the
+ * server can currently absorb beyond the data it has acknowledged. The sender
+ * should keep no more than this many bytes unacknowledged. When the window
+ * reopens after having been too small for a full payload, the server repeats
+ * its last ACK to advertise the new window. Otherwise na_window is zero.
+ *
+ * With NETDUMP_EXT_SACK, every ACK also lists the lowest ranges of vmcore
+ * offsets received so far, in ascending order. Data sent before the end of the
+ * last range listed and not covered by any range was lost or is late, and may
+ * be retransmitted. An ACK listing no ranges carries no information about
+ * losses.
+ *
+ * With NETDUMP_EXT_DELACK, ACKs other than that of the FINISHED message are
+ * cumulative: na_seqno is the highest seqno up to which every message was
+ * received. The server acknowledges VMCORE messages at least every nha_ackpkts
+ * messages, and no later than nha_ackusec microseconds after the first one left
+ * unacknowledged. Other messages, duplicates, and messages arriving out of
+ * order are acknowledged at once, so a repeated seqno hints at a loss.
+ */
+#define	NETDUMP_SACK_MAX	4
+
+struct netdump_sack {
+	uint64_t	ns_start;
+	uint64_t	ns_end;		/* Exclusive. */
+} __packed;
+
+struct netdump_ack_ext {
+	uint32_t	na_seqno;	/* As in struct netdump_ack. */
+	uint32_t	na_window;	/* Bytes. */
+	uint32_t	na_nsacks;
+	uint32_t	na__pad;
+	struct netdump_sack na_sacks[NETDUMP_SACK_MAX];
+} __packed;
+
+/*
+ * With NETDUMP_EXT_FEC, a stream's seqnos are split into groups of
+ * nha_fecgroup, group g holding seqnos g * nha_fecgroup onwards. After the
+ * VMCORE messages of a group, or at the end of the dump, the sender may send a
+ * NETDUMP_PARITY message covering the nf_count messages from mh_seqno on, all
+ * of which must be VMCORE messages of the same group. Its payload is a struct
+ * netdump_fec followed by the XOR of their payloads, each padded with zeroes
+ * to the longest one, and lets the server rebuild any single message of the
+ * group that was lost. Parity messages are not acknowledged. So that they fit
+ * in the negotiated payload size, VMCORE payloads must leave room for a struct
+ * netdump_fec.
+ */
+struct netdump_fec {
+	uint64_t	nf_offset;	/* XOR of the messages' offsets. */
+	uint32_t	nf_len;		/* XOR of the messages' lengths. */
+	uint32_t	nf_count;	/* Messages covered. */
+} __packed;
+
 struct netdump_conf {
 	char		ndc_iface[IFNAMSIZ];
 	struct in_addr	ndc_server;